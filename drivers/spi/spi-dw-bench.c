@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Loopback benchmark for the DesignWare SPI core
+ *
+ * Binds to a dummy device on a dw-apb-ssi controller, puts the controller
+ * in loopback (SPI_LOOP, CTRL0.SRL) and sweeps transfer size, word size,
+ * clock rate and transfer mode. Every transfer is checked for data
+ * integrity, throughput and p50/p99 latency are reported to the kernel
+ * log. No slave has to be attached, e.g.:
+ *
+ *	&spi1 {
+ *		spi-bench@1 {
+ *			compatible = "realtek,spi-dw-bench";
+ *			reg = <1>;
+ *			spi-max-frequency = <40000000>;
+ *		};
+ *	};
+ */
+
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/of.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spi/spi.h>
+
+#include "spi-dw.h"
+
+#define DW_BENCH_MAX_LEN	16384
+
+static unsigned int iterations = 100;
+module_param(iterations, uint, 0444);
+MODULE_PARM_DESC(iterations, "transfers per test point (default 100)");
+
+static unsigned int speeds[8];
+static int num_speeds;
+module_param_array(speeds, uint, &num_speeds, 0444);
+MODULE_PARM_DESC(speeds, "clock rates to sweep in Hz (default spi-max-frequency)");
+
+static const unsigned int dw_bench_lens[] = {
+	1, 4, 8, 16, 64, 256, 1024, 4096, DW_BENCH_MAX_LEN,
+};
+
+static const u8 dw_bench_bpws[] = { 8, 16, 32 };
+
+static const char * const dw_bench_mode_names[] = {
+	[DW_SPI_XFER_POLL]	= "poll",
+	[DW_SPI_XFER_IRQ]	= "irq",
+	[DW_SPI_XFER_DMA]	= "dma",
+};
+
+struct dw_bench {
+	struct spi_device	*spi;
+	struct dw_spi		*dws;
+	u8			*tx;
+	u8			*rx;
+	u64			*lat;		/* ns, one per iteration */
+};
+
+/* Pin the transfer mode by moving the DW core mode thresholds */
+static void dw_bench_set_mode(struct dw_spi *dws, enum dw_spi_xfer_mode mode)
+{
+	switch (mode) {
+	case DW_SPI_XFER_POLL:
+		dws->poll_ns = U32_MAX;
+		dws->dma_thresh = U32_MAX;
+		break;
+	case DW_SPI_XFER_IRQ:
+		dws->poll_ns = 0;
+		dws->dma_thresh = U32_MAX;
+		break;
+	case DW_SPI_XFER_DMA:
+		dws->poll_ns = 0;
+		dws->dma_thresh = 1;
+		break;
+	}
+}
+
+static int dw_bench_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int dw_bench_run(struct dw_bench *db, const char *mode, u32 speed,
+		u8 bpw, unsigned int len)
+{
+	struct spi_transfer xfer = {
+		.tx_buf		= db->tx,
+		.rx_buf		= db->rx,
+		.len		= len,
+		.bits_per_word	= bpw,
+		.speed_hz	= speed,
+	};
+	u64 total = 0, start;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < iterations; i++) {
+		prandom_bytes(db->tx, len);
+		memset(db->rx, 0, len);
+
+		start = ktime_get_ns();
+		ret = spi_sync_transfer(db->spi, &xfer, 1);
+		db->lat[i] = ktime_get_ns() - start;
+		if (ret) {
+			dev_err(&db->spi->dev, "%s %u Hz bpw %u len %u: error %d\n",
+				mode, speed, bpw, len, ret);
+			return ret;
+		}
+
+		if (memcmp(db->tx, db->rx, len)) {
+			dev_err(&db->spi->dev, "%s %u Hz bpw %u len %u: data mismatch\n",
+				mode, speed, bpw, len);
+			return -EIO;
+		}
+		total += db->lat[i];
+	}
+
+	sort(db->lat, iterations, sizeof(*db->lat), dw_bench_cmp_u64, NULL);
+
+	/* bytes per us is MB/s, kept with one decimal */
+	dev_info(&db->spi->dev,
+		 "%-4s %9u Hz bpw %2u len %5u: %5llu.%01llu MB/s p50 %7llu ns p99 %7llu ns\n",
+		 mode, speed, bpw, len,
+		 div64_u64((u64)len * iterations * 1000, total),
+		 div64_u64((u64)len * iterations * 10000, total) % 10,
+		 db->lat[iterations / 2], db->lat[iterations * 99 / 100]);
+	return 0;
+}
+
+static int dw_bench_sweep(struct dw_bench *db)
+{
+	struct spi_controller *ctlr = db->spi->controller;
+	struct dw_spi *dws = db->dws;
+	u32 poll_ns = dws->poll_ns, dma_thresh = dws->dma_thresh;
+	enum dw_spi_xfer_mode mode;
+	unsigned int b, l;
+	int s;
+	u32 speed;
+	int ret = 0;
+
+	for (mode = DW_SPI_XFER_POLL; mode <= DW_SPI_XFER_DMA; mode++) {
+		if (mode == DW_SPI_XFER_DMA && !ctlr->can_dma)
+			continue;
+
+		dw_bench_set_mode(dws, mode);
+		for (s = 0; s < max(num_speeds, 1); s++) {
+			speed = num_speeds ? speeds[s] : db->spi->max_speed_hz;
+			for (b = 0; b < ARRAY_SIZE(dw_bench_bpws); b++) {
+				u8 bpw = dw_bench_bpws[b];
+
+				if (!(ctlr->bits_per_word_mask & SPI_BPW_MASK(bpw)))
+					continue;
+
+				for (l = 0; l < ARRAY_SIZE(dw_bench_lens); l++) {
+					if (dw_bench_lens[l] % (bpw / 8))
+						continue;
+
+					ret = dw_bench_run(db,
+							   dw_bench_mode_names[mode],
+							   speed, bpw,
+							   dw_bench_lens[l]);
+					if (ret)
+						goto out;
+				}
+			}
+		}
+	}
+
+out:
+	dws->poll_ns = poll_ns;
+	dws->dma_thresh = dma_thresh;
+	return ret;
+}
+
+static int dw_bench_probe(struct spi_device *spi)
+{
+	struct device_node *np = spi->controller->dev.of_node;
+	struct dw_bench *db;
+	int ret;
+
+	if (!np || !of_device_is_compatible(np, "realtek,dw-apb-ssi")) {
+		dev_err(&spi->dev, "not on a DesignWare SSI controller\n");
+		return -ENODEV;
+	}
+
+	if (!iterations)
+		return -EINVAL;
+
+	db = devm_kzalloc(&spi->dev, sizeof(*db), GFP_KERNEL);
+	if (!db)
+		return -ENOMEM;
+
+	db->spi = spi;
+	db->dws = spi_controller_get_devdata(spi->controller);
+	db->tx = devm_kmalloc(&spi->dev, DW_BENCH_MAX_LEN, GFP_KERNEL);
+	db->rx = devm_kmalloc(&spi->dev, DW_BENCH_MAX_LEN, GFP_KERNEL);
+	db->lat = devm_kcalloc(&spi->dev, iterations, sizeof(*db->lat),
+			       GFP_KERNEL);
+	if (!db->tx || !db->rx || !db->lat)
+		return -ENOMEM;
+
+	spi->mode |= SPI_LOOP;
+	ret = spi_setup(spi);
+	if (ret)
+		return ret;
+
+	ret = dw_bench_sweep(db);
+
+	spi->mode &= ~SPI_LOOP;
+	spi_setup(spi);
+
+	return ret;
+}
+
+static const struct of_device_id dw_bench_of_match[] = {
+	{ .compatible = "realtek,spi-dw-bench", },
+	{ /* end of table */}
+};
+MODULE_DEVICE_TABLE(of, dw_bench_of_match);
+
+static const struct spi_device_id dw_bench_ids[] = {
+	{ "spi-dw-bench", 0 },
+	{ /* end of table */}
+};
+MODULE_DEVICE_TABLE(spi, dw_bench_ids);
+
+static struct spi_driver dw_bench_driver = {
+	.driver = {
+		.name		= "spi-dw-bench",
+		.of_match_table	= dw_bench_of_match,
+	},
+	.probe		= dw_bench_probe,
+	.id_table	= dw_bench_ids,
+};
+module_spi_driver(dw_bench_driver);
+
+MODULE_DESCRIPTION("Loopback benchmark for the DesignWare SPI core");
+MODULE_LICENSE("GPL v2");
@@ -29,8 +29,24 @@
 struct dw_spi_rts {
 	struct dw_spi  dws;
 	struct clk     *clk;
+
+	/*
+	 * The SSI DMA engine moves one contiguous region per SSI_START, so
+	 * a mapped transfer is run as a chain of segments walked from the
+	 * done interrupt. TX and RX tables may be split differently, each
+	 * step covers the largest run contiguous in both.
+	 */
+	struct scatterlist *tx_sg;
+	struct scatterlist *rx_sg;
+	unsigned int	tx_nents;
+	unsigned int	rx_nents;
+	u32		tx_off;		/* offset into current tx segment */
+	u32		rx_off;		/* offset into current rx segment */
+	u32		seg_len;	/* length of the step in flight */
+	size_t		dma_left;	/* bytes not yet completed */
 };
 
+#define to_dw_spi_rts(d)	container_of(d, struct dw_spi_rts, dws)
 
 static int rts_spi_dma_init(struct dw_spi *dws)
 {
@@ -40,24 +56,83 @@ static int rts_spi_dma_init(struct dw_spi *dws)
 
 static void rts_spi_dma_exit(struct dw_spi *dws) {}
 
-static int rts_spi_dma_setup(struct dw_spi *dws, struct spi_transfer *xfer)
+/* Program the next contiguous step of the chain, does not start it */
+static void rts_spi_dma_load_seg(struct dw_spi_rts *dwsrts)
 {
-	struct device dev;
-
-	dev = dws->master->dev;
-	if (xfer->tx_buf) {
-		/* set TX addr */
-		dws->dma_tx = (void *)dma_map_single(&dev, (void *)xfer->tx_buf, /// streaming dma mapping. xfer->tx_buf:虚拟地址 dws->dma_tx:总线地址
-			xfer->len, DMA_FROM_DEVICE); /// ??? 应该是DMA_TO_DEVICE
-		dw_writel(dws, SSI_RD_ADDR, (u32)dws->dma_tx);
+	struct dw_spi *dws = &dwsrts->dws;
+	u32 len = min_t(size_t, dwsrts->dma_left, U32_MAX);
+
+	if (dwsrts->tx_sg) {
+		len = min(len, sg_dma_len(dwsrts->tx_sg) - dwsrts->tx_off);
+		dw_writel(dws, SSI_RD_ADDR,
+			  (u32)(sg_dma_address(dwsrts->tx_sg) + dwsrts->tx_off));
 	}
-	if (xfer->rx_buf) {
-		/* set RX addr */
-		dws->dma_rx = (void *)dma_map_single(&dev, xfer->rx_buf, /// ??? 只有dma_map_single, 没有dma_unmap_single? 有些平台dma_unmap_single定义为NULL，这边不清楚。
-			xfer->len, DMA_FROM_DEVICE);
-		dw_writel(dws, SSI_WR_ADDR, (u32)dws->dma_rx);
+	if (dwsrts->rx_sg) {
+		len = min(len, sg_dma_len(dwsrts->rx_sg) - dwsrts->rx_off);
+		dw_writel(dws, SSI_WR_ADDR,
+			  (u32)(sg_dma_address(dwsrts->rx_sg) + dwsrts->rx_off));
 	}
-	dw_writel(dws, SSI_DATA_LEN, xfer->len);
+	dw_writel(dws, SSI_DATA_LEN, len);
+	dwsrts->seg_len = len;
+}
+
+static void rts_spi_dma_advance(struct scatterlist **sg, unsigned int *nents,
+		u32 *off, u32 len)
+{
+	if (!*sg)
+		return;
+
+	*off += len;
+	if (*off < sg_dma_len(*sg))
+		return;
+
+	*off = 0;
+	*sg = --(*nents) ? sg_next(*sg) : NULL;
+}
+
+static irqreturn_t rts_spi_dma_done(struct dw_spi *dws)
+{
+	struct dw_spi_rts *dwsrts = to_dw_spi_rts(dws);
+	u32 len = dwsrts->seg_len;
+
+	dwsrts->dma_left -= len;
+	rts_spi_dma_advance(&dwsrts->tx_sg, &dwsrts->tx_nents,
+			    &dwsrts->tx_off, len);
+	rts_spi_dma_advance(&dwsrts->rx_sg, &dwsrts->rx_nents,
+			    &dwsrts->rx_off, len);
+
+	if (dwsrts->dma_left) {
+		rts_spi_dma_load_seg(dwsrts);
+		dw_writel(dws, SSI_START, SPI_SSI_START);
+		return IRQ_HANDLED;
+	}
+
+	dw_writel(dws, SSI_IRQ_ENABLE, DONE_INT_DIS);
+	dw_spi_xfer_done(dws);
+	return IRQ_HANDLED;
+}
+
+/*
+ * The buffers are mapped by the SPI core from can_dma() with the proper
+ * direction for each table, and unmapped once the message is finalized,
+ * so only the scatterlists are consumed here.
+ */
+static int rts_spi_dma_setup(struct dw_spi *dws, struct spi_transfer *xfer)
+{
+	struct dw_spi_rts *dwsrts = to_dw_spi_rts(dws);
+
+	dwsrts->tx_nents = xfer->tx_buf ? xfer->tx_sg.nents : 0;
+	dwsrts->rx_nents = xfer->rx_buf ? xfer->rx_sg.nents : 0;
+	if (!dwsrts->tx_nents && !dwsrts->rx_nents)
+		return -EINVAL;
+
+	dwsrts->tx_sg = dwsrts->tx_nents ? xfer->tx_sg.sgl : NULL;
+	dwsrts->rx_sg = dwsrts->rx_nents ? xfer->rx_sg.sgl : NULL;
+	dwsrts->tx_off = 0;
+	dwsrts->rx_off = 0;
+	dwsrts->dma_left = xfer->len;
+
+	dws->transfer_handler = rts_spi_dma_done;
 
 	/* Set the interrupt mask */
 	dw_writel(dws, SSI_IRQ_ENABLE, DONE_INT_EN); ///enable transfer done interrupt
@@ -73,11 +148,13 @@ static bool rts_spi_can_dma(struct spi_controller *master,
 	if (!dws->dma_inited)
 		return false;
 
-	return xfer->len > dws->fifo_len;
+	return xfer->len >= dws->msg_dma_thresh;
 }
 
 static int rts_spi_dma_transfer(struct dw_spi *dws, struct spi_transfer *xfer)
 {
+	rts_spi_dma_load_seg(to_dw_spi_rts(dws));
+
 	/* start */
 	dw_writel(dws, SSI_START, SPI_SSI_START);
 
@@ -88,6 +165,7 @@ static void rts_spi_dma_stop(struct dw_spi *dws)
 {
 	/* stop */
 	dw_writel(dws, SSI_STOP, SPI_SSI_STOP);
+	dw_writel(dws, SSI_IRQ_ENABLE, DONE_INT_DIS);
 }
 
 static const struct dw_spi_dma_ops rts_dma_ops = {
@@ -106,6 +184,7 @@ static int dw_spi_rts_probe(struct platform_device *pdev)
 	struct resource *mem, *mem1;
 	int ret;
 	int num_cs;
+	u32 dma_transfer = 0;
 
 	dwsrts = devm_kzalloc(&pdev->dev, sizeof(struct dw_spi_rts),
 			GFP_KERNEL);
@@ -184,9 +263,9 @@ static int dw_spi_rts_probe(struct platform_device *pdev)
 
 	dws->num_cs = num_cs;
 
-	dws->dma_ops = &rts_dma_ops;
-
-	device_property_read_u32(&pdev->dev, "dma_transfer", &dws->dma_mapped); /// dma_transfer = <1>;
+	device_property_read_u32(&pdev->dev, "dma_transfer", &dma_transfer); /// dma_transfer = <1>;
+	if (dma_transfer)
+		dws->dma_ops = &rts_dma_ops;
 
 	ret = dw_spi_add_host(&pdev->dev, dws); /// 进入spi-dw.c
 	if (ret)
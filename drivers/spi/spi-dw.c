@@ -12,13 +12,25 @@
 #include <linux/delay.h>
 #include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include <asm/unaligned.h>
 
 #include "spi-dw.h"
 
 #ifdef CONFIG_DEBUG_FS
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #endif
 
+/* Fallback for poll_ns if the interrupt round trip can't be measured */
+#define DW_SPI_IRQ_COST_NS	4000
+#define DW_SPI_IRQ_CALIB_RUNS	8
+/* Rough cost of mapping a buffer and arming the DMA engine, not measured */
+#define DW_SPI_DMA_COST_NS	10000
+#define DW_SPI_DMA_THRESH_MAX	4096
+
 /* Slave spi_dev related */
 struct chip_data {
 	u8 tmode;		/* TR/TO/RO/EEPROM */
@@ -28,6 +40,7 @@ struct chip_data {
 
 	u16 clk_div;		/* baud rate divider */
 	u32 speed_hz;		/* baud rate */
+	u32 cr0;		/* CTRL0 without frame size and TMOD */
 	void (*cs_control)(u32 command);
 };
 
@@ -94,6 +107,125 @@ static const struct file_operations dw_spi_regs_ops = {
 	.llseek		= default_llseek,
 };
 
+static const char * const dw_spi_mode_names[] = {
+	[DW_SPI_XFER_POLL]	= "poll",
+	[DW_SPI_XFER_IRQ]	= "irq",
+	[DW_SPI_XFER_DMA]	= "dma",
+};
+
+static inline u64 dw_spi_stats_clock(void)
+{
+	return ktime_get_ns();
+}
+
+static inline void dw_spi_hist_add(u32 *hist, u64 val)
+{
+	hist[min_t(unsigned int, fls64(val), DW_SPI_HIST_BUCKETS - 1)]++;
+}
+
+static void dw_spi_stats_start(struct dw_spi *dws,
+		const struct dw_spi_xfer_cfg *cfg)
+{
+	struct dw_spi_stats *st = &dws->stats;
+	u64 now = dw_spi_stats_clock();
+
+	st->xfers[cfg->mode]++;
+	st->bytes[cfg->mode] += cfg->xfer->len;
+	dw_spi_hist_add(st->len_hist, cfg->xfer->len);
+	dw_spi_hist_add(st->setup_hist, now - cfg->t_setup);
+	st->t_start = now;
+	st->irqs = 0;
+}
+
+static void dw_spi_stats_done(struct dw_spi *dws)
+{
+	struct dw_spi_stats *st = &dws->stats;
+
+	dw_spi_hist_add(st->xfer_hist, dw_spi_stats_clock() - st->t_start);
+	dw_spi_hist_add(st->irq_hist, st->irqs);
+}
+
+static inline void dw_spi_stats_irq(struct dw_spi *dws)
+{
+	dws->stats.irqs++;
+}
+
+static void dw_spi_stats_error(struct dw_spi *dws, u16 irq_status)
+{
+	if (irq_status & SPI_INT_TXOI)
+		dws->stats.txo++;
+	if (irq_status & SPI_INT_RXOI)
+		dws->stats.rxo++;
+	if (irq_status & SPI_INT_RXUI)
+		dws->stats.rxu++;
+}
+
+/* Bucket 0 holds zero, bucket n holds [2^(n-1), 2^n) */
+static void dw_spi_show_hist(struct seq_file *s, const char *name,
+		const char *unit, const u32 *hist)
+{
+	int i;
+
+	seq_printf(s, "%s:\n", name);
+	for (i = 0; i < DW_SPI_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (!i)
+			seq_printf(s, "  %12u %s: %u\n", 0, unit, hist[i]);
+		else if (i == DW_SPI_HIST_BUCKETS - 1)
+			seq_printf(s, " >%12u %s: %u\n", 1U << (i - 1), unit,
+				   hist[i]);
+		else
+			seq_printf(s, " <%12u %s: %u\n", 1U << i, unit,
+				   hist[i]);
+	}
+}
+
+static int dw_spi_stats_show(struct seq_file *s, void *unused)
+{
+	struct dw_spi *dws = s->private;
+	struct dw_spi_stats *st = &dws->stats;
+	int i;
+
+	seq_puts(s, "mode      transfers            bytes\n");
+	for (i = 0; i < ARRAY_SIZE(dw_spi_mode_names); i++)
+		seq_printf(s, "%-4s %14llu %16llu\n", dw_spi_mode_names[i],
+			   st->xfers[i], st->bytes[i]);
+	seq_printf(s, "fifo errors: txo %llu rxo %llu rxu %llu\n",
+		   st->txo, st->rxo, st->rxu);
+
+	dw_spi_show_hist(s, "transfer length", "bytes", st->len_hist);
+	dw_spi_show_hist(s, "setup to start", "ns", st->setup_hist);
+	dw_spi_show_hist(s, "start to done", "ns", st->xfer_hist);
+	dw_spi_show_hist(s, "irqs per transfer", "irqs", st->irq_hist);
+	return 0;
+}
+
+static int dw_spi_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dw_spi_stats_show, inode->i_private);
+}
+
+/* Any write clears the statistics */
+static ssize_t dw_spi_stats_write(struct file *file,
+		const char __user *user_buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct dw_spi *dws = s->private;
+
+	memset(&dws->stats, 0, sizeof(dws->stats));
+	return count;
+}
+
+static const struct file_operations dw_spi_stats_ops = {
+	.owner		= THIS_MODULE,
+	.open		= dw_spi_stats_open,
+	.read		= seq_read,
+	.write		= dw_spi_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int dw_spi_debugfs_init(struct dw_spi *dws)
 {
 	char name[32];
@@ -105,6 +237,12 @@ static int dw_spi_debugfs_init(struct dw_spi *dws)
 
 	debugfs_create_file("registers", S_IFREG | S_IRUGO,
 		dws->debugfs, (void *)dws, &dw_spi_regs_ops);
+	debugfs_create_u32("poll_threshold_ns", S_IRUGO | S_IWUSR,
+		dws->debugfs, &dws->poll_ns);
+	debugfs_create_u32("dma_threshold", S_IRUGO | S_IWUSR,
+		dws->debugfs, &dws->dma_thresh);
+	debugfs_create_file("stats", S_IFREG | S_IRUGO | S_IWUSR,
+		dws->debugfs, (void *)dws, &dw_spi_stats_ops);
 	return 0;
 }
 
@@ -122,6 +260,28 @@ static inline int dw_spi_debugfs_init(struct dw_spi *dws)
 static inline void dw_spi_debugfs_remove(struct dw_spi *dws)
 {
 }
+
+static inline u64 dw_spi_stats_clock(void)
+{
+	return 0;
+}
+
+static inline void dw_spi_stats_start(struct dw_spi *dws,
+		const struct dw_spi_xfer_cfg *cfg)
+{
+}
+
+static inline void dw_spi_stats_done(struct dw_spi *dws)
+{
+}
+
+static inline void dw_spi_stats_irq(struct dw_spi *dws)
+{
+}
+
+static inline void dw_spi_stats_error(struct dw_spi *dws, u16 irq_status)
+{
+}
 #endif /* CONFIG_DEBUG_FS */
 
 void dw_spi_set_cs(struct spi_device *spi, bool enable)
@@ -179,13 +339,80 @@ static inline u32 rx_max(struct dw_spi *dws)
 	return min_t(u32, rx_left, dw_readl(dws, DW_SPI_RXFLR));
 }
 
-static void dw_writer(struct dw_spi *dws)
+/*
+ * FIFO fill/drain kernels, one per word layout, picked once per transfer
+ * in dw_spi_prepare_xfer() so the inner loops carry no per-word branches.
+ * The "be32" flavour packs four bytes of a byte stream into one 32-bit
+ * frame, most significant byte first as it goes out on the wire.
+ */
+#define dw_ld_native(p)		(*(p))
+#define dw_st_native(p, v)	(*(p) = (v))
+#define dw_ld_be32(p)		get_unaligned_be32(p)
+#define dw_st_be32(p, v)	put_unaligned_be32(v, p)
+
+#define DW_SPI_PIO_KERNELS(sfx, type, ld, st)				\
+static void dw_fill_##sfx(struct dw_spi *dws, u32 max)			\
+{									\
+	void __iomem *dr = dws->regs + DW_SPI_DR;			\
+	const type *tx = dws->tx;					\
+									\
+	for (; max >= 4; max -= 4, tx += 4) {				\
+		__raw_writel(ld(tx), dr);				\
+		__raw_writel(ld(tx + 1), dr);				\
+		__raw_writel(ld(tx + 2), dr);				\
+		__raw_writel(ld(tx + 3), dr);				\
+	}								\
+	while (max--)							\
+		__raw_writel(ld(tx++), dr);				\
+	dws->tx = (void *)tx;						\
+}									\
+									\
+static void dw_drain_##sfx(struct dw_spi *dws, u32 max)			\
+{									\
+	void __iomem *dr = dws->regs + DW_SPI_DR;			\
+	type *rx = dws->rx;						\
+									\
+	for (; max >= 4; max -= 4, rx += 4) {				\
+		st(rx, __raw_readl(dr));				\
+		st(rx + 1, __raw_readl(dr));				\
+		st(rx + 2, __raw_readl(dr));				\
+		st(rx + 3, __raw_readl(dr));				\
+	}								\
+	while (max--)							\
+		st(rx++, __raw_readl(dr));				\
+	dws->rx = rx;							\
+}
+
+DW_SPI_PIO_KERNELS(u8, u8, dw_ld_native, dw_st_native)
+DW_SPI_PIO_KERNELS(u16, u16, dw_ld_native, dw_st_native)
+DW_SPI_PIO_KERNELS(u32, u32, dw_ld_native, dw_st_native)
+DW_SPI_PIO_KERNELS(be32, u32, dw_ld_be32, dw_st_be32)
+
+/* No tx buffer: shift out zeroes */
+static void dw_fill_null(struct dw_spi *dws, u32 max)
+{
+	void __iomem *dr = dws->regs + DW_SPI_DR;
+
+	dws->tx += max * dws->n_bytes;
+	while (max--)
+		__raw_writel(0, dr);
+}
+
+/* No rx buffer: discard what was shifted in */
+static void dw_drain_null(struct dw_spi *dws, u32 max)
+{
+	void __iomem *dr = dws->regs + DW_SPI_DR;
+
+	dws->rx += max * dws->n_bytes;
+	while (max--)
+		__raw_readl(dr);
+}
+
+/* 16-bit wide DR, only 8/16-bit frames */
+static void dw_fill_io16(struct dw_spi *dws, u32 max)
 {
-	u32 max;
 	u16 txw = 0;
 
-	spin_lock(&dws->buf_lock);
-	max = tx_max(dws);
 	while (max--) {
 		/* Set the tx word if the transfer's original "tx" is not null */
 		if (dws->tx_end - dws->len) {
@@ -194,21 +421,17 @@ static void dw_writer(struct dw_spi *dws)
 			else
 				txw = *(u16 *)(dws->tx);
 		}
-		dw_write_io_reg(dws, DW_SPI_DR, txw);
+		dw_writew(dws, DW_SPI_DR, txw);
 		dws->tx += dws->n_bytes;
 	}
-	spin_unlock(&dws->buf_lock);
 }
 
-static void dw_reader(struct dw_spi *dws)
+static void dw_drain_io16(struct dw_spi *dws, u32 max)
 {
-	u32 max;
 	u16 rxw;
 
-	spin_lock(&dws->buf_lock);
-	max = rx_max(dws);
 	while (max--) {
-		rxw = dw_read_io_reg(dws, DW_SPI_DR);
+		rxw = dw_readw(dws, DW_SPI_DR);
 		/* Care rx only if the transfer's original "rx" is not null */
 		if (dws->rx_end - dws->len) {
 			if (dws->n_bytes == 1)
@@ -218,7 +441,51 @@ static void dw_reader(struct dw_spi *dws)
 		}
 		dws->rx += dws->n_bytes;
 	}
-	spin_unlock(&dws->buf_lock);
+}
+
+static void dw_spi_pick_pio(struct dw_spi *dws, struct spi_transfer *transfer,
+		struct dw_spi_xfer_cfg *cfg)
+{
+	if (dws->reg_io_width == 2) {
+		cfg->fill = dw_fill_io16;
+		cfg->drain = dw_drain_io16;
+		return;
+	}
+
+	if (cfg->packed) {
+		cfg->fill = dw_fill_be32;
+		cfg->drain = dw_drain_be32;
+	} else if (cfg->n_bytes == 1) {
+		cfg->fill = dw_fill_u8;
+		cfg->drain = dw_drain_u8;
+	} else if (cfg->n_bytes == 2) {
+		cfg->fill = dw_fill_u16;
+		cfg->drain = dw_drain_u16;
+	} else {
+		cfg->fill = dw_fill_u32;
+		cfg->drain = dw_drain_u32;
+	}
+
+	if (!transfer->tx_buf)
+		cfg->fill = dw_fill_null;
+	if (!transfer->rx_buf)
+		cfg->drain = dw_drain_null;
+}
+
+/*
+ * The transfer cursor (tx, rx and their ends) is set up by
+ * dw_spi_start_xfer() before the controller is enabled and only advanced
+ * by whoever drives the transfer afterwards: the FIFO interrupt, or the
+ * caller itself in poll mode. With a single writer no lock is needed.
+ */
+static void dw_writer(struct dw_spi *dws)
+{
+	dws->fill(dws, tx_max(dws));
+}
+
+static void dw_reader(struct dw_spi *dws)
+{
+	dws->drain(dws, rx_max(dws));
 }
 
 static void int_error_stop(struct dw_spi *dws, const char *msg)
@@ -227,24 +494,30 @@ static void int_error_stop(struct dw_spi *dws, const char *msg)
 
 	dev_err(&dws->master->dev, "%s\n", msg);
 	dws->master->cur_msg->status = -EIO;
-	spi_finalize_current_transfer(dws->master);
+
+	xchg(&dws->next_ready, NULL);
+	if (atomic_cmpxchg(&dws->pipe_state, DW_SPI_PIPE_EARLY,
+			   DW_SPI_PIPE_DONE) != DW_SPI_PIPE_EARLY)
+		spi_finalize_current_transfer(dws->master);
 }
 
 static irqreturn_t interrupt_transfer(struct dw_spi *dws)
 {
+	void *rx_end = smp_load_acquire(&dws->rx_end);
 	u16 irq_status = dw_readl(dws, DW_SPI_ISR);
 
 	/* Error handling */
 	if (irq_status & (SPI_INT_TXOI | SPI_INT_RXOI | SPI_INT_RXUI)) {
+		dw_spi_stats_error(dws, irq_status);
 		dw_readl(dws, DW_SPI_ICR);
 		int_error_stop(dws, "interrupt_transfer: fifo overrun/underrun");
 		return IRQ_HANDLED;
 	}
 
 	dw_reader(dws);
-	if (dws->rx_end == dws->rx) {
+	if (rx_end == dws->rx) {
 		spi_mask_intr(dws, SPI_INT_TXEI);
-		spi_finalize_current_transfer(dws->master);
+		dw_spi_xfer_done(dws);
 		return IRQ_HANDLED;
 	}
 	if (irq_status & SPI_INT_TXEI) {
@@ -273,14 +546,16 @@ static irqreturn_t dw_spi_irq(int irq, void *dev_id)
 			return IRQ_NONE;
 	}
 
+	dw_spi_stats_irq(dws);
+
 	if (dws->dma_mapped) {
 		dw_writel(dws, SSI_IRQ_STATUS, SSI_DONE_INT);
-		spi_finalize_current_transfer(dws->master);
-		return IRQ_HANDLED;
+		return dws->transfer_handler(dws);
 	}
 
 	if (!master->cur_msg) {
 		spi_mask_intr(dws, SPI_INT_TXEI);
+		complete(&dws->irq_calib);
 		return IRQ_HANDLED;
 	}
 
@@ -299,109 +574,306 @@ static int poll_transfer(struct dw_spi *dws)
 	return 0;
 }
 
-static int dw_spi_transfer_one(struct spi_controller *master,
-		struct spi_device *spi, struct spi_transfer *transfer)
+static void dw_spi_chip_set_speed(struct dw_spi *dws, struct chip_data *chip,
+		u32 speed_hz)
 {
-	struct dw_spi *dws = spi_controller_get_devdata(master);
-	struct chip_data *chip = spi_get_ctldata(spi);
-	unsigned long flags;
-	u8 imask = 0;
-	u16 txlevel = 0;
-	u32 cr0;
-	int ret;
-
-	spin_lock_irqsave(&dws->buf_lock, flags);
-	dws->tx = (void *)transfer->tx_buf;
-	dws->tx_end = dws->tx + transfer->len;
-	dws->rx = transfer->rx_buf;
-	dws->rx_end = dws->rx + transfer->len;
-	dws->len = transfer->len;
-	spin_unlock_irqrestore(&dws->buf_lock, flags);
+	/* clk_div doesn't support odd number */
+	chip->clk_div = (DIV_ROUND_UP(dws->max_freq, speed_hz) + 1) & 0xfffe;
+	chip->speed_hz = speed_hz;
+}
 
-	/* Ensure dw->rx and dw->rx_end are visible */
-	smp_mb();
+/* Time @len bytes spend on the wire at the bus rate @clk_div gives */
+static u64 dw_spi_wire_ns(struct dw_spi *dws, u16 clk_div, u32 len)
+{
+	u32 bps = max_t(u32, dws->max_freq / clk_div, 1);
 
-	spi_enable_chip(dws, 0);
+	return div_u64((u64)len * BITS_PER_BYTE * NSEC_PER_SEC, bps);
+}
 
-	/* Handle per transfer options for bpw and speed */
-	if (transfer->speed_hz != dws->current_freq) {
-		if (transfer->speed_hz != chip->speed_hz) {
-			/* clk_div doesn't support odd number */
-			chip->clk_div = (DIV_ROUND_UP(dws->max_freq, transfer->speed_hz) + 1) & 0xfffe;
-			chip->speed_hz = transfer->speed_hz;
-		}
-		dws->current_freq = transfer->speed_hz;
-		spi_set_clk(dws, chip->clk_div);
-	}
+/*
+ * Work out everything the controller needs for @transfer without touching
+ * the hardware, so that the setup can also be done ahead of time while the
+ * previous transfer is still on the wire.
+ */
+static void dw_spi_prepare_xfer(struct dw_spi *dws, struct spi_device *spi,
+		struct spi_transfer *transfer, struct dw_spi_xfer_cfg *cfg)
+{
+	struct spi_controller *master = dws->master;
+	struct chip_data *chip = spi_get_ctldata(spi);
+	u8 tmode = chip->tmode;
+	u8 bits;
 
-	dws->n_bytes = DIV_ROUND_UP(transfer->bits_per_word, BITS_PER_BYTE);
-	dws->dma_width = DIV_ROUND_UP(transfer->bits_per_word, BITS_PER_BYTE);
+	if (transfer->speed_hz != chip->speed_hz)
+		dw_spi_chip_set_speed(dws, chip, transfer->speed_hz);
 
-	/* Default SPI mode is SCPOL = 0, SCPH = 0 */
-	cr0 = (transfer->bits_per_word - 1)
-		| (chip->type << SPI_FRF_OFFSET)
-		| ((((spi->mode & SPI_CPOL) ? 1 : 0) << SPI_SCOL_OFFSET) |
-			(((spi->mode & SPI_CPHA) ? 1 : 0) << SPI_SCPH_OFFSET) |
-			(((spi->mode & SPI_LOOP) ? 1 : 0) << SPI_SRL_OFFSET))
-		| (chip->tmode << SPI_TMOD_OFFSET);
+	cfg->xfer = transfer;
+	cfg->t_setup = dw_spi_stats_clock();
+	cfg->speed_hz = transfer->speed_hz;
+	cfg->clk_div = chip->clk_div;
 
 	/*
 	 * Adjust transfer mode if necessary. Requires platform dependent
 	 * chipselect mechanism.
 	 */
 	if (chip->cs_control) {
-		if (dws->rx && dws->tx)
-			chip->tmode = SPI_TMOD_TR;
-		else if (dws->rx)
-			chip->tmode = SPI_TMOD_RO;
+		if (transfer->rx_buf && transfer->tx_buf)
+			tmode = SPI_TMOD_TR;
+		else if (transfer->rx_buf)
+			tmode = SPI_TMOD_RO;
 		else
-			chip->tmode = SPI_TMOD_TO;
-
-		cr0 &= ~SPI_TMOD_MASK;
-		cr0 |= (chip->tmode << SPI_TMOD_OFFSET);
+			tmode = SPI_TMOD_TO;
 	}
 
-	dw_writel(dws, DW_SPI_CTRL0, cr0);
 	/* Check if current transfer is a DMA transaction */
-	//if (master->can_dma && master->can_dma(master, spi, transfer))
-		//dws->dma_mapped = master->cur_msg_mapped;
+	if (master->cur_msg_mapped && master->can_dma &&
+	    master->can_dma(master, spi, transfer))
+		cfg->mode = DW_SPI_XFER_DMA;
+	else if (chip->poll_mode || dw_spi_wire_ns(dws, cfg->clk_div,
+						     transfer->len) <= dws->poll_ns)
+		cfg->mode = DW_SPI_XFER_POLL;
+	else
+		cfg->mode = DW_SPI_XFER_IRQ;
 
-	/* For poll mode just disable all interrupts */
-	spi_mask_intr(dws, 0xff);
+	/*
+	 * A byte stream can be moved four bytes per FIFO entry using 32-bit
+	 * frames. The wire sees the same bits, but a native slave select
+	 * toggles between frames when SCPH = 0, so only do it when that
+	 * cannot happen.
+	 */
+	bits = transfer->bits_per_word;
+	cfg->packed = bits == 8 && dws->dfs_offset == SPI_DFS32_OFFSET &&
+		      dws->reg_io_width != 2 && cfg->mode != DW_SPI_XFER_DMA &&
+		      !(transfer->len % 4) &&
+		      (spi->cs_gpiod || (spi->mode & SPI_CPHA));
+	if (cfg->packed)
+		bits = 32;
+
+	if (bits <= 8)
+		cfg->n_bytes = 1;
+	else if (bits <= 16)
+		cfg->n_bytes = 2;
+	else
+		cfg->n_bytes = 4;
+
+	cfg->cr0 = chip->cr0 | ((bits - 1) << dws->dfs_offset) |
+		   (tmode << SPI_TMOD_OFFSET);
+
+	dw_spi_pick_pio(dws, transfer, cfg);
+
+	cfg->txlevel = min_t(u16, dws->fifo_len / 2,
+			     transfer->len / cfg->n_bytes);
+}
+
+/*
+ * Program the controller from a prepared setup and start the transfer.
+ * Callers make sure the previous transfer is over, either from the core
+ * or from its completion interrupt.
+ */
+static int dw_spi_start_xfer(struct dw_spi *dws,
+		const struct dw_spi_xfer_cfg *cfg)
+{
+	struct spi_transfer *transfer = cfg->xfer;
+	bool reprogram;
+	u32 imask = 0;
+	int ret;
+
+	dws->tx = (void *)transfer->tx_buf;
+	dws->tx_end = dws->tx + transfer->len;
+	dws->rx = transfer->rx_buf;
+	dws->len = transfer->len;
+	dws->n_bytes = cfg->n_bytes;
+	dws->dma_width = cfg->n_bytes;
+	dws->fill = cfg->fill;
+	dws->drain = cfg->drain;
+	dws->dma_mapped = cfg->mode == DW_SPI_XFER_DMA;
+
+	/*
+	 * Publish the cursor before the controller can raise an interrupt,
+	 * pairs with the acquire in interrupt_transfer().
+	 */
+	smp_store_release(&dws->rx_end, transfer->rx_buf + transfer->len);
+
+	/*
+	 * Only touch the registers that differ from what the previous
+	 * transfer left behind. CTRL0, BAUDR and TXFLTR can only be written
+	 * with the controller disabled, when none of them changes the
+	 * enable toggle is skipped as well.
+	 */
+	if (cfg->mode == DW_SPI_XFER_IRQ)
+		imask = SPI_INT_TXEI | SPI_INT_TXOI |
+			SPI_INT_RXUI | SPI_INT_RXOI;
+
+	reprogram = cfg->cr0 != dws->shadow.cr0 ||
+		    cfg->clk_div != dws->shadow.baudr ||
+		    (imask && cfg->txlevel != dws->shadow.txfltr);
+	if (reprogram) {
+		spi_enable_chip(dws, 0);
+
+		/* Handle per transfer options for bpw and speed */
+		if (cfg->clk_div != dws->shadow.baudr)
+			spi_set_clk(dws, cfg->clk_div);
+
+		if (cfg->cr0 != dws->shadow.cr0) {
+			dw_writel(dws, DW_SPI_CTRL0, cfg->cr0);
+			dws->shadow.cr0 = cfg->cr0;
+		}
+
+		if (imask && cfg->txlevel != dws->shadow.txfltr) {
+			dw_writel(dws, DW_SPI_TXFLTR, cfg->txlevel);
+			dws->shadow.txfltr = cfg->txlevel;
+		}
+	}
 
 	/*
 	 * Interrupt mode
-	 * we only need set the TXEI IRQ, as TX/RX always happen syncronizely
+	 * we only need set the TXEI IRQ, as TX/RX always happen syncronizely,
+	 * poll and DMA mode just disable all interrupts.
 	 */
-	if (dws->dma_mapped) {
+	if (cfg->mode == DW_SPI_XFER_DMA) {
 		ret = dws->dma_ops->dma_setup(dws, transfer);
 		if (ret < 0) {
-			spi_enable_chip(dws, 1);
+			if (reprogram)
+				spi_enable_chip(dws, 1);
 			return ret;
 		}
-	} else if (!chip->poll_mode) {
-		txlevel = min_t(u16, dws->fifo_len / 2, dws->len / dws->n_bytes);
-		dw_writel(dws, DW_SPI_TXFLTR, txlevel);
-
-		/* Set the interrupt mask */
-		imask |= SPI_INT_TXEI | SPI_INT_TXOI |
-			 SPI_INT_RXUI | SPI_INT_RXOI;
-		spi_umask_intr(dws, imask);
-
+	} else if (cfg->mode == DW_SPI_XFER_IRQ) {
 		dws->transfer_handler = interrupt_transfer;
 	}
 
-	spi_enable_chip(dws, 1);
+	dw_spi_stats_start(dws, cfg);
+	if (dws->shadow.imr != imask)
+		spi_set_intr(dws, imask);
 
-	if (dws->dma_mapped)
+	if (reprogram)
+		spi_enable_chip(dws, 1);
+
+	if (cfg->mode == DW_SPI_XFER_DMA)
 		return dws->dma_ops->dma_transfer(dws, transfer);
 
-	if (chip->poll_mode)
-		return poll_transfer(dws);
+	if (cfg->mode == DW_SPI_XFER_POLL) {
+		ret = poll_transfer(dws);
+		dw_spi_stats_done(dws);
+		return ret;
+	}
 
 	return 1;
 }
 
+/*
+ * Stage the transfer following @transfer so its completion interrupt can
+ * start it right away. Only transfers the core would issue back to back
+ * qualify: no chipselect toggle or delay in between, and not polled.
+ *
+ * The staged setup is handed over to the interrupt through next_ready:
+ * it is filled in while unpublished and released once complete, the
+ * interrupt takes it with xchg() so each setup is consumed at most once.
+ */
+static void dw_spi_stage_next(struct dw_spi *dws, struct spi_device *spi,
+		struct spi_transfer *transfer)
+{
+	struct spi_message *msg = dws->master->cur_msg;
+	struct spi_transfer *next;
+
+	if (list_is_last(&transfer->transfer_list, &msg->transfers))
+		return;
+
+	if (transfer->cs_change || transfer->delay_usecs ||
+	    transfer->delay.value)
+		return;
+
+	next = list_next_entry(transfer, transfer_list);
+	if (!next->tx_buf && !next->rx_buf)
+		return;
+
+	dw_spi_prepare_xfer(dws, spi, next, &dws->next);
+	if (dws->next.mode == DW_SPI_XFER_POLL)
+		return;
+
+	smp_store_release(&dws->next_ready, &dws->next);
+}
+
+/**
+ * dw_spi_xfer_done - complete the transfer currently on the wire
+ * @dws: the controller
+ *
+ * Called from the completion interrupt instead of
+ * spi_finalize_current_transfer(). Starts the staged transfer, if any,
+ * before handing the finished one back to the core.
+ */
+void dw_spi_xfer_done(struct dw_spi *dws)
+{
+	struct dw_spi_xfer_cfg *next;
+
+	dw_spi_stats_done(dws);
+
+	/* Started ahead of the core, which has not asked for it yet */
+	if (atomic_cmpxchg(&dws->pipe_state, DW_SPI_PIPE_EARLY,
+			   DW_SPI_PIPE_DONE) == DW_SPI_PIPE_EARLY)
+		return;
+
+	next = xchg(&dws->next_ready, NULL);
+	if (next) {
+		WRITE_ONCE(dws->pipe_xfer, next->xfer);
+		atomic_set(&dws->pipe_state, DW_SPI_PIPE_EARLY);
+		if (dw_spi_start_xfer(dws, next) < 0) {
+			WRITE_ONCE(dws->pipe_xfer, NULL);
+			atomic_set(&dws->pipe_state, DW_SPI_PIPE_IDLE);
+		}
+	}
+
+	spi_finalize_current_transfer(dws->master);
+}
+EXPORT_SYMBOL_GPL(dw_spi_xfer_done);
+
+static int dw_spi_transfer_one(struct spi_controller *master,
+		struct spi_device *spi, struct spi_transfer *transfer)
+{
+	struct dw_spi *dws = spi_controller_get_devdata(master);
+	struct dw_spi_xfer_cfg *next, cfg;
+	int ret;
+
+	if (READ_ONCE(dws->pipe_xfer) == transfer) {
+		/* Already started from the previous completion interrupt */
+		WRITE_ONCE(dws->pipe_xfer, NULL);
+		if (atomic_xchg(&dws->pipe_state, DW_SPI_PIPE_IDLE) !=
+		    DW_SPI_PIPE_EARLY)
+			return 0;
+
+		dw_spi_stage_next(dws, spi, transfer);
+		return 1;
+	}
+
+	/* Reuse the staged setup if the early start did not happen */
+	next = xchg(&dws->next_ready, NULL);
+	if (next && next->xfer == transfer)
+		cfg = *next;
+	else
+		dw_spi_prepare_xfer(dws, spi, transfer, &cfg);
+	WRITE_ONCE(dws->pipe_xfer, NULL);
+	atomic_set(&dws->pipe_state, DW_SPI_PIPE_IDLE);
+
+	ret = dw_spi_start_xfer(dws, &cfg);
+	if (ret <= 0)
+		return ret;
+
+	dw_spi_stage_next(dws, spi, transfer);
+	return ret;
+}
+
+/*
+ * The SPI core asks can_dma() when it maps a message, again when it unmaps
+ * it, and dw_spi_prepare_xfer() asks it in between. Latch the debugfs
+ * threshold once per message so all of them get the same answer.
+ */
+static int dw_spi_prepare_message(struct spi_controller *master,
+		struct spi_message *msg)
+{
+	struct dw_spi *dws = spi_controller_get_devdata(master);
+
+	dws->msg_dma_thresh = READ_ONCE(dws->dma_thresh);
+	return 0;
+}
+
 static void dw_spi_handle_err(struct spi_controller *master,
 		struct spi_message *msg)
 {
@@ -411,11 +883,16 @@ static void dw_spi_handle_err(struct spi_controller *master,
 		dws->dma_ops->dma_stop(dws);
 
 	spi_reset_chip(dws);
+
+	xchg(&dws->next_ready, NULL);
+	WRITE_ONCE(dws->pipe_xfer, NULL);
+	atomic_set(&dws->pipe_state, DW_SPI_PIPE_IDLE);
 }
 
 /* This may be called twice for each spi dev */
 static int dw_spi_setup(struct spi_device *spi)
 {
+	struct dw_spi *dws = spi_controller_get_devdata(spi->controller);
 	struct dw_spi_chip *chip_info = NULL;
 	struct chip_data *chip;
 
@@ -445,6 +922,15 @@ static int dw_spi_setup(struct spi_device *spi)
 
 	chip->tmode = SPI_TMOD_TR;
 
+	/* Precompute what only depends on the device */
+	chip->cr0 = (chip->type << SPI_FRF_OFFSET)
+		| ((((spi->mode & SPI_CPOL) ? 1 : 0) << SPI_SCOL_OFFSET) |
+			(((spi->mode & SPI_CPHA) ? 1 : 0) << SPI_SCPH_OFFSET) |
+			(((spi->mode & SPI_LOOP) ? 1 : 0) << SPI_SRL_OFFSET));
+
+	if (spi->max_speed_hz && spi->max_speed_hz != chip->speed_hz)
+		dw_spi_chip_set_speed(dws, chip, spi->max_speed_hz);
+
 	return 0;
 }
 
@@ -480,9 +966,94 @@ static void spi_hw_init(struct device *dev, struct dw_spi *dws)
 		dev_info(dev, "Detected FIFO size: %u bytes\n", dws->fifo_len); /// 记得是8bytes
 	}
 
+	/*
+	 * Controllers synthesized with 32-bit frames keep the frame size in
+	 * CTRL0[20:16] and leave CTRL0[3:0] read-only zero.
+	 */
+	if (!dws->dfs_offset) {
+		u32 cr0, tmp = dw_readl(dws, DW_SPI_CTRL0);
+
+		spi_enable_chip(dws, 0);
+		dw_writel(dws, DW_SPI_CTRL0, 0xffffffff);
+		cr0 = dw_readl(dws, DW_SPI_CTRL0);
+		dw_writel(dws, DW_SPI_CTRL0, tmp);
+		spi_enable_chip(dws, 1);
+
+		if (!(cr0 & SPI_DFS_MASK))
+			dws->dfs_offset = SPI_DFS32_OFFSET;
+	}
+
 	/* enable HW fixup for explicit CS deselect for Amazon's alpine chip */
 	if (dws->cs_override)
 		dw_writel(dws, DW_SPI_CS_OVERRIDE, 0xF); /// 跳过
+
+	/* Registers may have been lost or overwritten by the probing above */
+	spi_shadow_invalidate(dws);
+}
+
+/*
+ * Time an interrupt round trip the way an IRQ mode transfer sees it: from
+ * unmasking TXEI until the sleeping caller runs again. The TX FIFO is empty
+ * with a threshold of 0, so the interrupt fires at once. Returns the best
+ * of a few runs in ns, or 0 if no interrupt arrived.
+ */
+static u32 dw_spi_measure_irq(struct dw_spi *dws)
+{
+	u64 best = U64_MAX, start;
+	int i;
+
+	dw_writel(dws, DW_SPI_TXFLTR, 0);
+	dws->shadow.txfltr = 0;
+
+	for (i = 0; i < DW_SPI_IRQ_CALIB_RUNS; i++) {
+		reinit_completion(&dws->irq_calib);
+		start = ktime_get_ns();
+		spi_umask_intr(dws, SPI_INT_TXEI);
+		if (!wait_for_completion_timeout(&dws->irq_calib,
+						 msecs_to_jiffies(10))) {
+			spi_mask_intr(dws, SPI_INT_TXEI);
+			return 0;
+		}
+		best = min(best, ktime_get_ns() - start);
+	}
+
+	return min_t(u64, best, U32_MAX);
+}
+
+/*
+ * Pick the per-transfer mode thresholds for this controller. Transfers
+ * that are on the wire, at their own speed_hz, for less than the measured
+ * interrupt round trip are polled, and DMA is used once moving the data
+ * word by word over the APB would cost more than setting up the DMA engine
+ * and taking its completion interrupt. Both can be tuned through debugfs
+ * afterwards.
+ */
+static void dw_spi_calibrate(struct device *dev, struct dw_spi *dws)
+{
+	u32 mmio_ns, irq_ns;
+	ktime_t start;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < 32; i++)
+		dw_readl(dws, DW_SPI_SR);
+	mmio_ns = max_t(u32, ktime_to_ns(ktime_sub(ktime_get(), start)) / 32, 1);
+
+	irq_ns = dw_spi_measure_irq(dws);
+	if (!irq_ns) {
+		dev_warn(dev, "no calibration irq, assuming %u ns\n",
+			 DW_SPI_IRQ_COST_NS);
+		irq_ns = DW_SPI_IRQ_COST_NS;
+	}
+	dws->poll_ns = irq_ns;
+
+	/* Each PIO word costs at least one DR access plus a FIFO level read */
+	dws->dma_thresh = clamp_t(u32, DIV_ROUND_UP(DW_SPI_DMA_COST_NS + irq_ns,
+						    2 * mmio_ns),
+				  dws->fifo_len + 1, DW_SPI_DMA_THRESH_MAX);
+
+	dev_dbg(dev, "mmio %u ns, irq %u ns, poll <= %u ns, dma >= %u bytes\n",
+		mmio_ns, irq_ns, dws->poll_ns, dws->dma_thresh);
 }
 
 int dw_spi_add_host(struct device *dev, struct dw_spi *dws)
@@ -500,7 +1071,8 @@ int dw_spi_add_host(struct device *dev, struct dw_spi *dws)
 	dws->type = SSI_MOTO_SPI;
 	dws->dma_inited = 0;
 	// dws->dma_addr = (dma_addr_t)(dws->paddr + DW_SPI_DR);
-	spin_lock_init(&dws->buf_lock);
+	atomic_set(&dws->pipe_state, DW_SPI_PIPE_IDLE);
+	init_completion(&dws->irq_calib);
 
 	spi_controller_set_devdata(master, dws);
 
@@ -519,6 +1091,7 @@ int dw_spi_add_host(struct device *dev, struct dw_spi *dws)
 	master->setup = dw_spi_setup;
 	master->cleanup = dw_spi_cleanup;
 	master->set_cs = dw_spi_set_cs;
+	master->prepare_message = dw_spi_prepare_message;
 	master->transfer_one = dw_spi_transfer_one;
 	master->handle_err = dw_spi_handle_err;
 	master->max_speed_hz = dws->max_freq;
@@ -531,6 +1104,9 @@ int dw_spi_add_host(struct device *dev, struct dw_spi *dws)
 
 	/* Basic HW init */
 	spi_hw_init(dev, dws);
+	if (dws->dfs_offset == SPI_DFS32_OFFSET && dws->reg_io_width != 2)
+		master->bits_per_word_mask = SPI_BPW_RANGE_MASK(4, 32);
+	dw_spi_calibrate(dev, dws);
 
 	if (dws->dma_ops && dws->dma_ops->dma_init) {
 		ret = dws->dma_ops->dma_init(dws);
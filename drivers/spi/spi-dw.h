@@ -3,6 +3,7 @@
 #define DW_SPI_HEADER_H
 
 #include <linux/io.h>
+#include <linux/completion.h>
 #include <linux/scatterlist.h>
 #include <linux/gpio.h>
 
@@ -59,6 +60,8 @@
 
 /* Bit fields in CTRLR0 */
 #define SPI_DFS_OFFSET			0
+#define SPI_DFS_MASK			GENMASK(3, 0)
+#define SPI_DFS32_OFFSET		16
 
 #define SPI_FRF_OFFSET			4
 #define SPI_FRF_SPI			0x0
@@ -122,7 +125,57 @@ enum dw_ssi_type {
 	SSI_NS_MICROWIRE,
 };
 
+enum dw_spi_xfer_mode {
+	DW_SPI_XFER_POLL = 0,
+	DW_SPI_XFER_IRQ,
+	DW_SPI_XFER_DMA,
+};
+
+/* State of a transfer started from the previous completion interrupt */
+enum dw_spi_pipe_state {
+	DW_SPI_PIPE_IDLE = 0,
+	DW_SPI_PIPE_EARLY,	/* running, not yet issued by the core */
+	DW_SPI_PIPE_DONE,	/* finished before the core issued it */
+};
+
 struct dw_spi;
+
+/* Precomputed controller setup of one transfer */
+struct dw_spi_xfer_cfg {
+	struct spi_transfer	*xfer;
+	u32			cr0;
+	u32			speed_hz;
+	u16			clk_div;
+	u16			txlevel;
+	u8			n_bytes;	/* bytes per FIFO entry */
+	u8			mode;		/* enum dw_spi_xfer_mode */
+	bool			packed;		/* 4 bytes per 32-bit frame */
+	u64			t_setup;	/* when it was prepared, in ns */
+	void (*fill)(struct dw_spi *dws, u32 max);
+	void (*drain)(struct dw_spi *dws, u32 max);
+};
+
+#ifdef CONFIG_DEBUG_FS
+#define DW_SPI_HIST_BUCKETS		24
+
+/* Per controller transfer statistics, log2 histograms, see debugfs "stats" */
+struct dw_spi_stats {
+	u64			xfers[3];	/* per enum dw_spi_xfer_mode */
+	u64			bytes[3];
+	u64			txo;		/* tx FIFO overflows */
+	u64			rxo;		/* rx FIFO overflows */
+	u64			rxu;		/* rx FIFO underflows */
+	u32			len_hist[DW_SPI_HIST_BUCKETS];
+	u32			setup_hist[DW_SPI_HIST_BUCKETS];
+	u32			xfer_hist[DW_SPI_HIST_BUCKETS];
+	u32			irq_hist[DW_SPI_HIST_BUCKETS];
+
+	/* Transfer on the wire */
+	u64			t_start;
+	u32			irqs;
+};
+#endif
+
 struct dw_spi_dma_ops {
 	int (*dma_init)(struct dw_spi *dws);
 	void (*dma_exit)(struct dw_spi *dws);
@@ -154,14 +207,33 @@ struct dw_spi {
 	size_t			len;
 	void			*tx;
 	void			*tx_end;
-	spinlock_t		buf_lock;
 	void			*rx;
 	void			*rx_end;
 	int			dma_mapped;
-	u8			n_bytes;	/* current is a 1/2 bytes op */
+	u8			n_bytes;	/* current is a 1/2/4 bytes op */
+	u8			dfs_offset;	/* frame size field in CTRL0 */
+	void (*fill)(struct dw_spi *dws, u32 max);	/* tx FIFO fill kernel */
+	void (*drain)(struct dw_spi *dws, u32 max);	/* rx FIFO drain kernel */
 	u32			dma_width;
 	irqreturn_t		(*transfer_handler)(struct dw_spi *dws);
-	u32			current_freq;	/* frequency in hz */
+
+	/* Last values written to the controller, U32_MAX when unknown */
+	struct {
+		u32		cr0;
+		u32		baudr;
+		u32		txfltr;
+		u32		imr;
+	} shadow;
+	u32			poll_ns;	/* poll transfers shorter on the wire */
+	struct completion	irq_calib;	/* idle TXEI seen, for calibration */
+	u32			dma_thresh;	/* DMA from this length on */
+	u32			msg_dma_thresh;	/* dma_thresh for the current message */
+
+	/* Transfer pipelining, see dw_spi_stage_next() */
+	struct dw_spi_xfer_cfg	next;		/* staged following transfer */
+	struct dw_spi_xfer_cfg	*next_ready;	/* &next once published */
+	struct spi_transfer	*pipe_xfer;	/* started ahead of the core */
+	atomic_t		pipe_state;	/* enum dw_spi_pipe_state */
 
 	/* DMA info */
 	int			dma_inited;
@@ -170,13 +242,12 @@ struct dw_spi {
 	unsigned long		dma_chan_busy;
 	dma_addr_t		dma_addr; /* phy address of the Data register */
 	const struct dw_spi_dma_ops *dma_ops;
-	void			*dma_tx;
-	void			*dma_rx;
 
 	/* Bus interface info */
 	void			*priv;
 #ifdef CONFIG_DEBUG_FS
 	struct dentry *debugfs;
+	struct dw_spi_stats	stats;
 #endif
 };
 
@@ -242,24 +313,43 @@ static inline void spi_enable_chip(struct dw_spi *dws, int enable)
 static inline void spi_set_clk(struct dw_spi *dws, u16 div)
 {
 	dw_writel(dws, DW_SPI_BAUDR, div);
+	dws->shadow.baudr = div;
+}
+
+/*
+ * Forget the cached CTRL0/BAUDR/TXFLTR values and re-read IMR, e.g. after
+ * a power loss. IMR is re-synced rather than invalidated because the
+ * mask helpers below build on its shadow value.
+ */
+static inline void spi_shadow_invalidate(struct dw_spi *dws)
+{
+	dws->shadow.cr0 = U32_MAX;
+	dws->shadow.baudr = U32_MAX;
+	dws->shadow.txfltr = U32_MAX;
+	dws->shadow.imr = dw_readl(dws, DW_SPI_IMR);
+}
+
+/*
+ * IMR is only ever written through these helpers, and re-read by
+ * spi_shadow_invalidate() when the controller may have lost it, so the
+ * read-modify-write needs no MMIO read.
+ */
+static inline void spi_set_intr(struct dw_spi *dws, u32 new_mask)
+{
+	dws->shadow.imr = new_mask;
+	dw_writel(dws, DW_SPI_IMR, new_mask);
 }
 
 /* Disable IRQ bits */
 static inline void spi_mask_intr(struct dw_spi *dws, u32 mask)
 {
-	u32 new_mask;
-
-	new_mask = dw_readl(dws, DW_SPI_IMR) & ~mask;
-	dw_writel(dws, DW_SPI_IMR, new_mask); /// 把中断mask都写成0，disable irq
+	spi_set_intr(dws, dws->shadow.imr & ~mask); /// 把中断mask都写成0，disable irq
 }
 
 /* Enable IRQ bits */
 static inline void spi_umask_intr(struct dw_spi *dws, u32 mask)
 {
-	u32 new_mask;
-
-	new_mask = dw_readl(dws, DW_SPI_IMR) | mask;
-	dw_writel(dws, DW_SPI_IMR, new_mask);
+	spi_set_intr(dws, dws->shadow.imr | mask);
 }
 
 /*
@@ -294,6 +384,7 @@ struct dw_spi_chip {
 };
 
 extern void dw_spi_set_cs(struct spi_device *spi, bool enable);
+extern void dw_spi_xfer_done(struct dw_spi *dws);
 extern int dw_spi_add_host(struct device *dev, struct dw_spi *dws);
 extern void dw_spi_remove_host(struct dw_spi *dws);
 extern int dw_spi_suspend_host(struct dw_spi *dws);
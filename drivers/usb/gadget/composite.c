@@ -313,6 +313,94 @@ int config_ep_by_speed(struct usb_gadget *g,
 }
 EXPORT_SYMBOL_GPL(config_ep_by_speed);
 
+/*
+ * Replies to GET_DESCRIPTOR(CONFIG/OTHER_SPEED_CONFIG/BOS/STRING) are kept
+ * once built, keyed by everything they depend on, so the enumeration that
+ * follows every bus reset doesn't walk the config and function lists
+ * again.  Adding or removing a config or function drops the whole cache.
+ */
+#define DESC_CACHE_MAX	32
+
+struct composite_desc_cache {
+	struct list_head	list;
+	u8			type;
+	u8			index;
+	u16			lang;
+	u8			speed;
+	u16			len;
+	u8			buf[];
+};
+
+static int desc_cache_lookup(struct usb_composite_dev *cdev, u8 type,
+		u8 index, u16 lang, u8 speed, void *buf)
+{
+	struct composite_desc_cache	*dc;
+	unsigned long			flags;
+	int				len = -ENOENT;
+
+	spin_lock_irqsave(&cdev->lock, flags);
+	list_for_each_entry(dc, &cdev->desc_cache, list) {
+		if (dc->type == type && dc->index == index &&
+		    dc->lang == lang && dc->speed == speed) {
+			memcpy(buf, dc->buf, dc->len);
+			len = dc->len;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&cdev->lock, flags);
+
+	return len;
+}
+
+/* called from setup, failing to cache only costs a rebuild next time */
+static void desc_cache_store(struct usb_composite_dev *cdev, u8 type,
+		u8 index, u16 lang, u8 speed, const void *buf, int len)
+{
+	struct composite_desc_cache	*dc, *iter;
+	unsigned long			flags;
+	unsigned			count = 0;
+
+	if (len <= 0)
+		return;
+
+	dc = kmalloc(struct_size(dc, buf, len), GFP_ATOMIC);
+	if (!dc)
+		return;
+
+	dc->type = type;
+	dc->index = index;
+	dc->lang = lang;
+	dc->speed = speed;
+	dc->len = len;
+	memcpy(dc->buf, buf, len);
+
+	/* the host picks the keys, don't let it grow the list without bound */
+	spin_lock_irqsave(&cdev->lock, flags);
+	list_for_each_entry(iter, &cdev->desc_cache, list)
+		count++;
+	if (count < DESC_CACHE_MAX) {
+		list_add(&dc->list, &cdev->desc_cache);
+		dc = NULL;
+	}
+	spin_unlock_irqrestore(&cdev->lock, flags);
+
+	kfree(dc);
+}
+
+static void desc_cache_invalidate(struct usb_composite_dev *cdev)
+{
+	struct composite_desc_cache	*dc, *tmp;
+	unsigned long			flags;
+	LIST_HEAD(stale);
+
+	spin_lock_irqsave(&cdev->lock, flags);
+	list_splice_init(&cdev->desc_cache, &stale);
+	spin_unlock_irqrestore(&cdev->lock, flags);
+
+	list_for_each_entry_safe(dc, tmp, &stale, list)
+		kfree(dc);
+}
+
 /**
  * usb_add_function() - add a function to a configuration
  * @config: the configuration
@@ -372,6 +460,8 @@ int usb_add_function(struct usb_configuration *config,
 	if (!config->superspeed_plus && function->ssp_descriptors)
 		config->superspeed_plus = true;
 
+	desc_cache_invalidate(config->cdev);
+
 done:
 	if (value)
 		DBG(config->cdev, "adding '%s'/%p --> %d\n",
@@ -390,6 +480,8 @@ void usb_remove_function(struct usb_configuration *c, struct usb_function *f)
 	if (f->unbind)
 		f->unbind(c, f);
 
+	desc_cache_invalidate(c->cdev);
+
 	if (f->bind_deactivated)
 		usb_function_activate(f);
 }
@@ -600,6 +692,8 @@ static int config_desc(struct usb_composite_dev *cdev, unsigned w_value)
 	struct list_head		*pos;
 	u8				type = w_value >> 8;
 	enum usb_device_speed		speed = USB_SPEED_UNKNOWN;
+	u8				index;
+	int				len;
 
 	if (gadget->speed >= USB_SPEED_SUPER)
 		speed = gadget->speed;
@@ -617,6 +711,11 @@ static int config_desc(struct usb_composite_dev *cdev, unsigned w_value)
 	/* This is a lookup by config *INDEX* */
 	w_value &= 0xff;
 
+	index = w_value;
+	len = desc_cache_lookup(cdev, type, index, 0, speed, cdev->req->buf);
+	if (len >= 0)
+		return len;
+
 	pos = &cdev->configs;
 	c = cdev->os_desc_config;
 	if (c)
@@ -649,8 +748,12 @@ check_config:
 				continue;
 		}
 
-		if (w_value == 0)
-			return config_buf(c, speed, cdev->req->buf, type);
+		if (w_value == 0) {
+			len = config_buf(c, speed, cdev->req->buf, type);
+			desc_cache_store(cdev, type, index, 0, speed,
+					 cdev->req->buf, len);
+			return len;
+		}
 		w_value--;
 	}
 	return -EINVAL;
@@ -1115,6 +1218,7 @@ int usb_add_config_only(struct usb_composite_dev *cdev,
 	config->next_interface_id = 0;
 	memset(config->interface, 0, sizeof(config->interface));
 
+	desc_cache_invalidate(cdev);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(usb_add_config_only);
@@ -1215,6 +1319,7 @@ static void remove_config(struct usb_composite_dev *cdev,
 		usb_remove_function(config, f);
 	}
 	list_del(&config->list);
+	desc_cache_invalidate(cdev);
 	if (config->unbind) {
 		DBG(cdev, "unbind config '%s'/%p\n", config->label, config);
 		config->unbind(config);
@@ -1813,6 +1918,7 @@ composite_setup(struct usb_gadget *gadget, const struct usb_ctrlrequest *ctrl)
 	u8				intf = w_index & 0xFF;
 	u16				w_value = le16_to_cpu(ctrl->wValue);
 	u16				w_length = le16_to_cpu(ctrl->wLength);
+	u16				lang;
 	struct usb_function		*f = NULL;
 	u8				endp;
 
@@ -1898,17 +2004,34 @@ composite_setup(struct usb_gadget *gadget, const struct usb_ctrlrequest *ctrl)
 				value = min(w_length, (u16) value);
 			break;
 		case USB_DT_STRING:
-			value = get_string(cdev, req->buf,
-					w_index, w_value & 0xff);
+			/* string 0 is the language table, wIndex is unused */
+			lang = (w_value & 0xff) ? w_index : 0;
+			value = desc_cache_lookup(cdev, USB_DT_STRING,
+					w_value & 0xff, lang, 0, req->buf);
+			if (value < 0) {
+				value = get_string(cdev, req->buf,
+						w_index, w_value & 0xff);
+				desc_cache_store(cdev, USB_DT_STRING,
+						w_value & 0xff, lang, 0,
+						req->buf, value);
+			}
 			if (value >= 0)
 				value = min(w_length, (u16) value);
 			break;
 		case USB_DT_BOS:
 			if (gadget_is_superspeed(gadget) ||
 			    gadget->lpm_capable) {
-				value = bos_desc(cdev);
+				value = desc_cache_lookup(cdev, USB_DT_BOS,
+						0, 0, 0, req->buf);
+				if (value < 0) {
+					value = bos_desc(cdev);
+					desc_cache_store(cdev, USB_DT_BOS,
+							0, 0, 0, req->buf,
+							value);
+				}
 				value = min(w_length, (u16) value);
 			} else {
+				/* depends on the DFU detach state, not cached */
 				value = msbos_desc(cdev);
 				value = min_t(u16, w_length, value);
 			}
@@ -2360,6 +2483,8 @@ int composite_dev_prepare(struct usb_composite_driver *composite,
 	struct usb_gadget *gadget = cdev->gadget;
 	int ret = -ENOMEM;
 
+	INIT_LIST_HEAD(&cdev->desc_cache);
+
 	/* preallocate control response and buffer */
 	cdev->req = usb_ep_alloc_request(gadget->ep0, GFP_KERNEL);
 	if (!cdev->req)
@@ -2452,6 +2577,7 @@ void composite_dev_cleanup(struct usb_composite_dev *cdev)
 		usb_ep_free_request(cdev->gadget->ep0, cdev->req);
 		cdev->req = NULL;
 	}
+	desc_cache_invalidate(cdev);
 	cdev->next_string_id = 0;
 	device_remove_file(&cdev->gadget->dev, &dev_attr_suspended);
 
@@ -13,6 +13,8 @@
 #include <linux/device.h>
 #include <linux/module.h>
 #include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/usb/composite.h>
 
 #include "g_zero.h"
@@ -24,7 +26,27 @@
  * This takes messages of various sizes written OUT to a device, and loops
  * them back so they can be read IN from it.  It has been used by certain
  * test applications.  It supports limited testing of data queueing logic.
+ *
+ * Completions are counted per direction so it doubles as a device side
+ * throughput benchmark, e.g. against dummy_hcd: read the configfs "report"
+ * attribute (or the summary logged when the interface is disabled) after
+ * a host side run, and sweep qlen/bulk_buflen between runs.
  */
+#define LB_HIST_BUCKETS		32
+
+enum { LB_OUT, LB_IN, LB_DIRS };
+
+struct lb_dir_stats {
+	u64			bytes;
+	u64			requests;
+	/* active window, first to last completion */
+	u64			first_ns;
+	u64			first_bytes;
+	u64			last_ns;
+	/* log2 ns between completions */
+	u32			interval_hist[LB_HIST_BUCKETS];
+};
+
 struct f_loopback {
 	struct usb_function	function;
 
@@ -33,6 +55,11 @@ struct f_loopback {
 
 	unsigned                qlen;
 	unsigned                buflen;
+
+	/* reset each time the interface is enabled, under stats_lock */
+	spinlock_t		stats_lock;
+	u64			start_ns;
+	struct lb_dir_stats	stats[LB_DIRS];
 };
 
 static inline struct f_loopback *func_to_loop(struct usb_function *f)
@@ -226,12 +253,76 @@ static void lb_free_func(struct usb_function *f)
 
 	mutex_lock(&opts->lock);
 	opts->refcnt--;
+	if (opts->loop == func_to_loop(f))
+		opts->loop = NULL;
 	mutex_unlock(&opts->lock);
 
 	usb_free_all_descriptors(f);
 	kfree(func_to_loop(f));
 }
 
+static const char * const lb_dir_names[] = {
+	[LB_OUT]	= "out",
+	[LB_IN]		= "in",
+};
+
+static void lb_stats_reset(struct f_loopback *loop)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop->stats_lock, flags);
+	memset(loop->stats, 0, sizeof(loop->stats));
+	loop->start_ns = ktime_get_ns();
+	spin_unlock_irqrestore(&loop->stats_lock, flags);
+}
+
+/* consistent copy for reporting, completions may be running */
+static void lb_stats_snapshot(struct f_loopback *loop,
+			      struct lb_dir_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop->stats_lock, flags);
+	memcpy(stats, loop->stats, sizeof(loop->stats));
+	spin_unlock_irqrestore(&loop->stats_lock, flags);
+}
+
+static void lb_stats_complete(struct f_loopback *loop, int dir,
+			      struct usb_request *req)
+{
+	struct lb_dir_stats *st = &loop->stats[dir];
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop->stats_lock, flags);
+	if (st->requests) {
+		st->interval_hist[min_t(unsigned int, fls64(now - st->last_ns),
+					LB_HIST_BUCKETS - 1)]++;
+	} else {
+		st->first_ns = now;
+		st->first_bytes = req->actual;
+	}
+	st->last_ns = now;
+	st->requests++;
+	st->bytes += req->actual;
+	spin_unlock_irqrestore(&loop->stats_lock, flags);
+}
+
+/*
+ * Throughput over the active window only, so idle time before the host
+ * starts or after it stops doesn't dilute it. The first completion opens
+ * the window, its bytes moved before it and are left out. Bytes per us is
+ * MB/s, kept with one decimal.
+ */
+static void lb_stats_rate(const struct lb_dir_stats *st, u64 *mbs, u64 *frac)
+{
+	u64 elapsed = st->last_ns - st->first_ns;
+	u64 bytes = st->bytes - st->first_bytes;
+
+	*mbs = elapsed ? div64_u64(bytes * 1000, elapsed) : 0;
+	*frac = elapsed ? div64_u64(bytes * 10000, elapsed) % 10 : 0;
+}
+
 static void loopback_complete(struct usb_ep *ep, struct usb_request *req)
 {
 	struct f_loopback	*loop = ep->driver_data;
@@ -240,6 +331,8 @@ static void loopback_complete(struct usb_ep *ep, struct usb_request *req)
 
 	switch (status) {
 	case 0:				/* normal completion? */
+		lb_stats_complete(loop, ep == loop->in_ep ? LB_IN : LB_OUT,
+				  req);
 		if (ep == loop->out_ep) {
 			/*
 			 * We received some data from the host so let's
@@ -296,10 +389,24 @@ free_req:
 static void disable_loopback(struct f_loopback *loop)
 {
 	struct usb_composite_dev	*cdev;
+	struct lb_dir_stats	stats[LB_DIRS];
+	u64 mbs, frac;
+	int dir;
 
 	cdev = loop->function.config->cdev;
 	disable_endpoints(cdev, loop->in_ep, loop->out_ep, NULL, NULL);
 	VDBG(cdev, "%s disabled\n", loop->function.name);
+
+	lb_stats_snapshot(loop, stats);
+	if (!stats[LB_OUT].requests)
+		return;
+
+	for (dir = 0; dir < LB_DIRS; dir++) {
+		lb_stats_rate(&stats[dir], &mbs, &frac);
+		INFO(cdev, "%s %s: %llu requests %llu bytes %llu.%01llu MB/s\n",
+		     loop->function.name, lb_dir_names[dir],
+		     stats[dir].requests, stats[dir].bytes, mbs, frac);
+	}
 }
 
 static inline struct usb_request *lb_alloc_ep_req(struct usb_ep *ep, int len)
@@ -307,12 +414,26 @@ static inline struct usb_request *lb_alloc_ep_req(struct usb_ep *ep, int len)
 	return alloc_ep_req(ep, len);
 }
 
+static void free_requests(struct f_loopback *loop,
+			  struct usb_request **reqs, int n)
+{
+	while (n--) {
+		usb_ep_free_request(loop->in_ep, reqs[n]->context);
+		free_ep_req(loop->out_ep, reqs[n]);
+	}
+}
+
 static int alloc_requests(struct usb_composite_dev *cdev,
 			  struct f_loopback *loop)
 {
+	struct usb_request **reqs;
 	struct usb_request *in_req, *out_req;
-	int i;
-	int result = 0;
+	int n, queued;
+	int result = -ENOMEM;
+
+	reqs = kcalloc(loop->qlen, sizeof(*reqs), GFP_ATOMIC);
+	if (!reqs)
+		return -ENOMEM;
 
 	/*
 	 * allocate a bunch of read buffers and queue them all at once.
@@ -320,16 +441,16 @@ static int alloc_requests(struct usb_composite_dev *cdev,
 	 * for out transfer and reuse them in IN transfers to implement
 	 * our loopback functionality
 	 */
-	for (i = 0; i < loop->qlen && result == 0; i++) {
-		result = -ENOMEM;
-
+	for (n = 0; n < loop->qlen; n++) {
 		in_req = usb_ep_alloc_request(loop->in_ep, GFP_ATOMIC);
 		if (!in_req)
 			goto fail;
 
 		out_req = lb_alloc_ep_req(loop->out_ep, loop->buflen);
-		if (!out_req)
-			goto fail_in;
+		if (!out_req) {
+			usb_ep_free_request(loop->in_ep, in_req);
+			goto fail;
+		}
 
 		in_req->complete = loopback_complete;
 		out_req->complete = loopback_complete;
@@ -339,21 +460,24 @@ static int alloc_requests(struct usb_composite_dev *cdev,
 		in_req->context = out_req;
 		out_req->context = in_req;
 
-		result = usb_ep_queue(loop->out_ep, out_req, GFP_ATOMIC);
-		if (result) {
-			ERROR(cdev, "%s queue req --> %d\n",
-					loop->out_ep->name, result);
-			goto fail_out;
-		}
+		reqs[n] = out_req;
 	}
 
-	return 0;
+	queued = usb_ep_queue_many(loop->out_ep, reqs, n, GFP_ATOMIC);
+	if (queued == n) {
+		result = 0;
+		goto out;
+	}
+
+	result = reqs[queued]->status;
+	ERROR(cdev, "%s queue req --> %d\n", loop->out_ep->name, result);
+	free_requests(loop, reqs + queued, n - queued);
+	goto out;
 
-fail_out:
-	free_ep_req(loop->out_ep, out_req);
-fail_in:
-	usb_ep_free_request(loop->in_ep, in_req);
 fail:
+	free_requests(loop, reqs, n);
+out:
+	kfree(reqs);
 	return result;
 }
 
@@ -389,6 +513,7 @@ enable_loopback(struct usb_composite_dev *cdev, struct f_loopback *loop)
 	if (result)
 		goto disable_in;
 
+	lb_stats_reset(loop);
 	result = alloc_requests(cdev, loop);
 	if (result)
 		goto disable_out;
@@ -430,11 +555,13 @@ static struct usb_function *loopback_alloc(struct usb_function_instance *fi)
 	loop = kzalloc(sizeof *loop, GFP_KERNEL);
 	if (!loop)
 		return ERR_PTR(-ENOMEM);
+	spin_lock_init(&loop->stats_lock);
 
 	lb_opts = container_of(fi, struct f_lb_opts, func_inst);
 
 	mutex_lock(&lb_opts->lock);
 	lb_opts->refcnt++;
+	lb_opts->loop = loop;
 	mutex_unlock(&lb_opts->lock);
 
 	loop->buflen = lb_opts->bulk_buflen;
@@ -546,9 +673,85 @@ end:
 
 CONFIGFS_ATTR(f_lb_opts_, bulk_buflen);
 
+/* Bucket 0 holds zero, bucket n holds [2^(n-1), 2^n) */
+static ssize_t lb_report_hist(char *page, ssize_t len, const u32 *hist)
+{
+	int i;
+
+	for (i = 0; i < LB_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (!i)
+			len += scnprintf(page + len, PAGE_SIZE - len,
+					 "    %12u ns: %u\n", 0, hist[i]);
+		else if (i == LB_HIST_BUCKETS - 1)
+			len += scnprintf(page + len, PAGE_SIZE - len,
+					 "   >%12u ns: %u\n", 1U << (i - 1),
+					 hist[i]);
+		else
+			len += scnprintf(page + len, PAGE_SIZE - len,
+					 "   <%12u ns: %u\n", 1U << i, hist[i]);
+	}
+	return len;
+}
+
+/* Statistics since the interface was last enabled */
+static ssize_t f_lb_opts_report_show(struct config_item *item, char *page)
+{
+	struct f_lb_opts *opts = to_f_lb_opts(item);
+	struct f_loopback *loop;
+	struct lb_dir_stats stats[LB_DIRS];
+	const struct lb_dir_stats *st;
+	u64 mbs, frac;
+	ssize_t len = 0;
+	int dir;
+
+	mutex_lock(&opts->lock);
+	loop = opts->loop;
+	if (!loop || !loop->start_ns) {
+		mutex_unlock(&opts->lock);
+		return sprintf(page, "not running\n");
+	}
+
+	lb_stats_snapshot(loop, stats);
+	len += scnprintf(page + len, PAGE_SIZE - len,
+			 "qlen %u buflen %u\n", loop->qlen, loop->buflen);
+	for (dir = 0; dir < LB_DIRS; dir++) {
+		st = &stats[dir];
+		lb_stats_rate(st, &mbs, &frac);
+		len += scnprintf(page + len, PAGE_SIZE - len,
+				 "%-3s %llu requests %llu bytes in %llu ns %llu.%01llu MB/s\n",
+				 lb_dir_names[dir], st->requests, st->bytes,
+				 st->last_ns - st->first_ns, mbs, frac);
+		len += scnprintf(page + len, PAGE_SIZE - len,
+				 "  completion interval:\n");
+		len = lb_report_hist(page, len, st->interval_hist);
+	}
+	mutex_unlock(&opts->lock);
+
+	return len;
+}
+
+/* Any write restarts the measurement */
+static ssize_t f_lb_opts_report_store(struct config_item *item,
+				      const char *page, size_t len)
+{
+	struct f_lb_opts *opts = to_f_lb_opts(item);
+
+	mutex_lock(&opts->lock);
+	if (opts->loop)
+		lb_stats_reset(opts->loop);
+	mutex_unlock(&opts->lock);
+
+	return len;
+}
+
+CONFIGFS_ATTR(f_lb_opts_, report);
+
 static struct configfs_attribute *lb_attrs[] = {
 	&f_lb_opts_attr_qlen,
 	&f_lb_opts_attr_bulk_buflen,
+	&f_lb_opts_attr_report,
 	NULL,
 };
 
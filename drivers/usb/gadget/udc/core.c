@@ -286,6 +286,63 @@ out:
 }
 EXPORT_SYMBOL_GPL(usb_ep_queue);
 
+/**
+ * usb_ep_queue_many - queues several requests on an endpoint in one call
+ * @ep: the endpoint associated with the requests
+ * @reqs: the requests, queued in array order
+ * @count: number of entries in @reqs
+ * @gfp_flags: GFP_* flags to use if the lower level driver couldn't
+ *	pre-allocate all necessary memory with the requests.
+ *
+ * Same as calling usb_ep_queue() for each request in turn, but a UDC that
+ * implements the queue_many() hook can link the whole batch under a single
+ * lock acquisition.  Useful for function drivers that refill a queue of
+ * many requests at once.
+ *
+ * This routine may be called in interrupt context.
+ *
+ * Returns the number of requests queued.  Queueing stops at the first
+ * request that is refused; if fewer than @count were queued, that request's
+ * ->status holds the error code and its ->complete() will not be called.
+ * The requests after it were not submitted.
+ */
+int usb_ep_queue_many(struct usb_ep *ep, struct usb_request **reqs,
+		      unsigned int count, gfp_t gfp_flags)
+{
+	unsigned int i, queued = 0;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	if (WARN_ON_ONCE(!ep->enabled && ep->address)) {
+		reqs[0]->status = -ESHUTDOWN;
+		goto out;
+	}
+
+	if (ep->ops->queue_many) {
+		queued = ep->ops->queue_many(ep, reqs, count, gfp_flags);
+		goto out;
+	}
+
+	for (; queued < count; queued++) {
+		ret = ep->ops->queue(ep, reqs[queued], gfp_flags);
+		if (ret) {
+			reqs[queued]->status = ret;
+			break;
+		}
+	}
+
+out:
+	for (i = 0; i < queued; i++)
+		trace_usb_ep_queue(ep, reqs[i], 0);
+	if (queued < count)
+		trace_usb_ep_queue(ep, reqs[queued], reqs[queued]->status);
+
+	return queued;
+}
+EXPORT_SYMBOL_GPL(usb_ep_queue_many);
+
 /**
  * usb_ep_dequeue - dequeues (cancels, unlinks) an I/O request from an endpoint
  * @ep:the endpoint associated with the request
@@ -13,17 +13,39 @@
 #include <linux/clk.h>
 #include <linux/types.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/usb/phy.h>
 #include <linux/of_device.h>
 #include <linux/usb/gadget.h>
 #include <linux/suspend.h>
 #include "core.h"
 
+#ifdef CONFIG_DEBUG_FS
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 static const char		rts_usb_driver_name[] = "rts_usb_device";
 static void __iomem		*usb_base;
 static void __iomem		*mc_base;
 static struct rts_mcm		*mcm[RTS_MCM_MAX_COUNT];
 
+/*
+ * Answer repeated class GET_* requests to an interface (UVC probe/commit,
+ * GET_MIN/MAX/RES/DEF/INFO, UAC GET_CUR ...) from a snapshot of the
+ * function driver's last reply, inside the irq. The snapshot is dropped on
+ * any class request to the same interface with a host to device data
+ * stage, on SET_INTERFACE, SET_CONFIGURATION and bus reset. Only safe for
+ * functions whose answers do not change otherwise.
+ */
+static bool ep0_cache;
+module_param(ep0_cache, bool, 0444);
+MODULE_PARM_DESC(ep0_cache, "serve repeated class control reads from a cache (default n)");
+
 static const struct udc_devtype_data rts3917_devtype = {
 	.quirks = UDC_QUIRK_DYNAMIC_MAXPKTSIZE,
 };
@@ -99,6 +121,19 @@ static inline void mc_set_reg_bit(int bit, u32 offset)
 	mc_write_reg(v, offset);
 }
 
+/*
+ * rts_ep_lock
+ * Lock protecting an endpoint's queue and state. ep0 shares the device lock
+ * with setup and reset handling; the other endpoints have their own, which
+ * nest outside the device lock.
+ */
+static inline spinlock_t *rts_ep_lock(struct rts_endpoint *priv_ep)
+{
+	struct rts_udc *rtsusb = priv_ep->rts_dev;
+
+	return priv_ep == rtsusb->ep_in[0] ? &rtsusb->lock : &priv_ep->lock;
+}
+
 /*
  * rts_set_cxstall
  * EP0 return host stall
@@ -256,6 +291,8 @@ static void rts_set_epnum(struct rts_endpoint *priv_ep, u32 epnum)
 
 static void rts_set_ep_enable(struct rts_endpoint *priv_ep, u32 epnum)
 {
+	int i;
+
 	RTS_DEBUG("%s()\n", __func__);
 	priv_ep->ep_enable = 1;
 
@@ -272,6 +309,10 @@ static void rts_set_ep_enable(struct rts_endpoint *priv_ep, u32 epnum)
 		case 4:
 			priv_ep->is_uac_in = 1;
 			priv_ep->uac_cnt = 0;
+			priv_ep->uac_filled = 0;
+			for (i = 0; i < RTS_UAC_RING_REGS; i++)
+				priv_ep->uac_pktsize[i] = usb_read_reg(
+					USB_UACINEP_PKTSIZE0 + i * 4);
 			usb_set_reg_bit(UACEP_EN_OFFSET, USB_UACINEP_CFG);
 			break;
 		case 5:
@@ -359,6 +400,7 @@ static void rts_set_ep_maxpkt(struct rts_endpoint *priv_ep, u16 max_pkt_size)
 
 static int rts_set_ep_irq_enable(struct rts_endpoint *priv_ep)
 {
+	struct rts_udc *rtsusb = priv_ep->rts_dev;
 	u32 epnum = priv_ep->epnum;
 
 	RTS_DEBUG("%s() ep %d\n", __func__, priv_ep->epnum);
@@ -370,10 +412,12 @@ static int rts_set_ep_irq_enable(struct rts_endpoint *priv_ep)
 				MC_FIFO0_IRQ + 0x100 * priv_ep->mcnum);
 			mc_set_reg_bit(INT_LASTPKT_DONE_EN_OFFSET,
 				MC_FIFO0_IRQ_EN + 0x100 * priv_ep->mcnum);
+			set_bit(priv_ep->mcnum, &rtsusb->mc_irq_en);
 			break;
 		case 7 ... 12:
 			usb_set_reg_bit(IE_INTEP_IN_OFFSET,
 				USB_INTEREPA_IRQ_EN + 0x80 * (epnum - 7));
+			set_bit(epnum, &rtsusb->intr_irq_en);
 			break;
 		default:
 			break;
@@ -384,6 +428,7 @@ static int rts_set_ep_irq_enable(struct rts_endpoint *priv_ep)
 				MC_FIFO0_IRQ + 0x100 * priv_ep->mcnum);
 			mc_set_reg_bit(INT_DMA_DONE_EN_OFFSET,
 				MC_FIFO0_IRQ_EN + 0x100 * priv_ep->mcnum);
+			set_bit(priv_ep->mcnum, &rtsusb->mc_irq_en);
 		}
 	}
 
@@ -394,6 +439,7 @@ static int rts_set_ep_irq_enable(struct rts_endpoint *priv_ep)
 
 static int rts_set_ep_irq_disable(struct rts_endpoint *priv_ep)
 {
+	struct rts_udc *rtsusb = priv_ep->rts_dev;
 	u32 epnum = priv_ep->epnum;
 
 	RTS_DEBUG("%s() ep %d\n", __func__, priv_ep->epnum);
@@ -403,54 +449,89 @@ static int rts_set_ep_irq_disable(struct rts_endpoint *priv_ep)
 		case 1 ... 6:
 			mc_clr_reg_bit(INT_LASTPKT_DONE_EN_OFFSET,
 				MC_FIFO0_IRQ_EN + 0x100 * priv_ep->mcnum);
+			clear_bit(priv_ep->mcnum, &rtsusb->mc_irq_en);
 			break;
 		case 7 ... 12:
 			usb_clr_reg_bit(IE_INTEP_IN_OFFSET,
 				USB_INTEREPA_IRQ_EN + 0x80 * (epnum - 7));
+			clear_bit(epnum, &rtsusb->intr_irq_en);
 			break;
 		default:
 			break;
 		}
 	} else {
-		if (epnum)
+		if (epnum) {
 			mc_clr_reg_bit(INT_DMA_DONE_EN_OFFSET,
 				MC_FIFO0_IRQ_EN + 0x100 * priv_ep->mcnum);
+			clear_bit(priv_ep->mcnum, &rtsusb->mc_irq_en);
+		}
 	}
 	return 0;
 }
 
-static int mcm_uvc[2] = {0, 1};
-static int mcm_in[3] = {2, 3, 4};
-static int mcm_out[3] = {5, 6, 7};
+/*
+ * MC FIFOs are handed out when an endpoint is enabled. Each class has its
+ * preferred FIFOs, which keeps the usual uvc + uac + bulk composites on the
+ * same FIFOs as before, and falls back to any FIFO left free so other mixes
+ * can use all of them.
+ */
+static const u8 mcm_pref_uvc[] = {0, 1};
+static const u8 mcm_pref_in[] = {2, 3, 4};
+static const u8 mcm_pref_out[] = {5, 6, 7};
+
+static int rts_alloc_mc_fifo(const u8 *pref, int npref)
+{
+	int i;
+
+	for (i = 0; i < npref; i++)
+		if (!mcm[pref[i]]->claimed)
+			return pref[i];
+
+	for (i = 0; i < RTS_MCM_MAX_COUNT; i++)
+		if (!mcm[i]->claimed)
+			return i;
+
+	return -EBUSY;
+}
+
 static int rts_set_ep_fifo_mapping(struct rts_endpoint *priv_ep, u32 epnum)
 {
+	int mcnum;
+
+	if (priv_ep->dir_in && (epnum == 5 || epnum == 6))
+		mcnum = rts_alloc_mc_fifo(mcm_pref_uvc,
+					  ARRAY_SIZE(mcm_pref_uvc));
+	else if (priv_ep->dir_in)
+		mcnum = rts_alloc_mc_fifo(mcm_pref_in, ARRAY_SIZE(mcm_pref_in));
+	else
+		mcnum = rts_alloc_mc_fifo(mcm_pref_out,
+					  ARRAY_SIZE(mcm_pref_out));
+	if (mcnum < 0)
+		return mcnum;
+	priv_ep->mcnum = mcnum;
+
+	RTS_DEBUG("%s() -> ep%d %s mc%d\n", __func__, epnum,
+		  priv_ep->dir_in ? "in" : "out", mcnum);
+
 	if (priv_ep->dir_in) {
 		switch (epnum) {
 		case 1 ... 3:
-			priv_ep->mcnum = mcm_in[epnum - 1];
-			if (mcm[priv_ep->mcnum]->claimed)
-				return -EINVAL;
 			usb_write_reg_mask((1 << priv_ep->mcnum) <<
 					EP_BUF_EN_SEL_OFFSET,
 					USB_BULKINEPA_CFG + 0x40 * (epnum - 1),
 					EP_BUF_EN_SEL_MASK);
 			break;
 		case 4:
-			priv_ep->mcnum = mcm_in[epnum - 2];
-			if (mcm[priv_ep->mcnum]->claimed)
-				return -EINVAL;
 			usb_write_reg_mask((1 << priv_ep->mcnum) <<
 					UACEP_BUF_EN_SEL_OFFSET,
 					USB_UACINEP_CFG, UACEP_BUF_EN_SEL_MASK);
 			break;
 		case 5:
-			priv_ep->mcnum = mcm_uvc[epnum - 5];
 			usb_write_reg_mask((1 << priv_ep->mcnum) <<
 					EP_BUF_EN_SEL_OFFSET,
 					USB_UVCINEPA_CFG, EP_BUF_EN_SEL_MASK);
 			break;
 		case 6:
-			priv_ep->mcnum = mcm_uvc[epnum - 5];
 			usb_write_reg_mask((1 << priv_ep->mcnum) <<
 					EP_BUF_EN_SEL_OFFSET,
 					USB_UVCINEPB_CFG, EP_BUF_EN_SEL_MASK);
@@ -462,18 +543,12 @@ static int rts_set_ep_fifo_mapping(struct rts_endpoint *priv_ep, u32 epnum)
 	} else {
 		switch (epnum) {
 		case 1 ... 3:
-			priv_ep->mcnum = mcm_out[epnum - 1];
-			if (mcm[priv_ep->mcnum]->claimed)
-				return -EINVAL;
 			usb_write_reg_mask((1 << priv_ep->mcnum) <<
 					EP_BUF_EN_SEL_OFFSET,
 					USB_BULKOUTEPA_CFG + 0x40 * (epnum - 1),
 					EP_BUF_EN_SEL_MASK);
 			break;
 		case 4:
-			priv_ep->mcnum = mcm_out[epnum - 2];
-			if (mcm[priv_ep->mcnum]->claimed)
-				return -EINVAL;
 			usb_write_reg_mask((1 << priv_ep->mcnum) <<
 					   UACEP_BUF_EN_SEL_OFFSET,
 					   USB_UACOUTEP_CFG,
@@ -493,6 +568,48 @@ static int rts_set_ep_fifo_mapping(struct rts_endpoint *priv_ep, u32 epnum)
 	return 0;
 }
 
+/*
+ * rts_uvc_build_plan
+ * Packetization for the uvc in endpoints by request length, worked out once
+ * from wMaxPacketSize:
+ *  short:  pid 0, maxpkt shrunk to the request
+ *  single: pid 0, full maxpkt
+ *  multi:  all transactions per microframe, full maxpkt
+ */
+static void rts_uvc_build_plan(struct rts_endpoint *priv_ep,
+			       const struct usb_endpoint_descriptor *desc)
+{
+	struct rts_uvc_plan *plan = &priv_ep->uvc_plan;
+	u16 maxpid = (desc->wMaxPacketSize >> 11) & 0x3;
+	u32 ep_maxpkt = desc->wMaxPacketSize & 0x7FF;
+	u32 payload = ep_maxpkt > 12 ? ep_maxpkt - 12 : 0;
+
+	plan->limit[RTS_UVC_SHORT] = payload ? payload - 1 : 0;
+	plan->pid[RTS_UVC_SHORT] = 0;
+	plan->maxpkt[RTS_UVC_SHORT] = 0;
+
+	plan->limit[RTS_UVC_SINGLE] = payload * (maxpid + 1);
+	plan->pid[RTS_UVC_SINGLE] = 0;
+	plan->maxpkt[RTS_UVC_SINGLE] = ep_maxpkt;
+
+	plan->limit[RTS_UVC_MULTI] = U32_MAX;
+	plan->pid[RTS_UVC_MULTI] = maxpid;
+	plan->maxpkt[RTS_UVC_MULTI] = ep_maxpkt;
+}
+
+/* one iso service interval, 0 for other transfer types */
+static u64 rts_ep_interval_ns(struct rts_endpoint *priv_ep,
+			      const struct usb_endpoint_descriptor *desc)
+{
+	unsigned int exp = clamp_t(unsigned int, desc->bInterval, 1, 16) - 1;
+
+	if (!usb_endpoint_xfer_isoc(desc))
+		return 0;
+	if (priv_ep->rts_dev->gadget.speed == USB_SPEED_HIGH)
+		return (u64)NSEC_PER_USEC * 125 << exp;
+	return (u64)NSEC_PER_MSEC << exp;
+}
+
 static int rts_config_ep(struct rts_endpoint *priv_ep,
 			 const struct usb_endpoint_descriptor *desc)
 {
@@ -508,11 +625,19 @@ static int rts_config_ep(struct rts_endpoint *priv_ep,
 
 	if ((priv_ep->epnum > 0 && priv_ep->epnum < 7 && priv_ep->dir_in)
 				|| (priv_ep->epnum && priv_ep->dir_out)) {
+		spin_lock(&rtsusb->lock);
 		ret = rts_set_ep_fifo_mapping(priv_ep, priv_ep->epnum);
+		spin_unlock(&rtsusb->lock);
 		if (ret)
 			return ret;
 	}
 
+	/* force the first rts_usb_write_header_len() to program USB_DUMMY0 */
+	priv_ep->hdr_len = U32_MAX;
+	priv_ep->interval_ns = rts_ep_interval_ns(priv_ep, desc);
+	if (priv_ep->epnum == 5 || priv_ep->epnum == 6)
+		rts_uvc_build_plan(priv_ep, desc);
+
 	if (priv_ep->epnum == 5) {
 		usb_write_reg(UVC_HEAD, USB_UVCINEPA_PHINF0);
 		usb_write_reg_mask(pid << EP_ISOTYPE1_0_OFFSET,
@@ -589,6 +714,8 @@ static int rts_ep_enable(struct usb_ep *ep,
 			 const struct usb_endpoint_descriptor *desc)
 {
 	struct rts_endpoint *priv_ep = ep_to_rts_ep(ep);
+	unsigned long flags;
+	int ret;
 
 	RTS_DEBUG("%s()\n", __func__);
 
@@ -601,39 +728,11 @@ static int rts_ep_enable(struct usb_ep *ep,
 	priv_ep->dir_out = usb_endpoint_dir_out(desc);
 	priv_ep->endpoint.maxpacket = usb_endpoint_maxp(desc);
 
-	return rts_config_ep(priv_ep, desc);
-}
-
-static void rts_done_wq(struct rts_endpoint *priv_ep,
-			struct rts_request *priv_req, int status)
-{
-	bool stopped = priv_ep->stopped;
-
-	RTS_DEBUG("%s() ep %d\n", __func__, priv_ep->epnum);
+	spin_lock_irqsave(&priv_ep->lock, flags);
+	ret = rts_config_ep(priv_ep, desc);
+	spin_unlock_irqrestore(&priv_ep->lock, flags);
 
-	list_del_init(&priv_req->queue);
-
-	priv_ep->stopped = 1;
-
-	/* don't modify queue heads during completion callback */
-	if (priv_ep->rts_dev->gadget.speed == USB_SPEED_UNKNOWN)
-		priv_req->request.status = -ESHUTDOWN;
-	else
-		priv_req->request.status = status;
-
-	if (list_empty(&priv_ep->queue)) {
-		RTS_DEBUG("ep%d->queue is empty", priv_ep->epnum);
-		rts_set_ep_irq_disable(priv_ep);
-	}
-
-	usb_gadget_unmap_request(&priv_ep->rts_dev->gadget,
-				 &priv_req->request, priv_ep->dir_in);
-
-	usb_gadget_giveback_request(&priv_ep->endpoint, &priv_req->request);
-
-	if (priv_ep->rts_dev->request_pending > 0)
-		--priv_ep->rts_dev->request_pending;
-	priv_ep->stopped = stopped;
+	return ret;
 }
 
 static int __set_filterout(struct rts_endpoint *priv_ep,
@@ -658,6 +757,330 @@ static int __set_filterout(struct rts_endpoint *priv_ep,
 	return retval;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static const char * const rts_irq_src_names[] = {
+	[RTS_IRQ_SE0]		= "se0",
+	[RTS_IRQ_SETUP]		= "setup",
+	[RTS_IRQ_EP0_IN]	= "ep0 in",
+	[RTS_IRQ_EP0_OUT]	= "ep0 out",
+	[RTS_IRQ_INTR_IN]	= "intr in",
+	[RTS_IRQ_BULK_IN]	= "bulk in",
+	[RTS_IRQ_BULK_OUT]	= "bulk out",
+	[RTS_IRQ_UAC_IN]	= "uac in",
+	[RTS_IRQ_UAC_OUT]	= "uac out",
+	[RTS_IRQ_UVC_IN]	= "uvc in",
+	[RTS_IRQ_NONE]		= "none",
+};
+
+static inline u64 rts_stats_clock(void)
+{
+	return ktime_get_ns();
+}
+
+static inline void rts_hist_add(u32 *hist, u64 val)
+{
+	hist[min_t(unsigned int, fls64(val), RTS_HIST_BUCKETS - 1)]++;
+}
+
+static void rts_stats_queue(struct rts_endpoint *priv_ep,
+			    struct rts_request *priv_req)
+{
+	priv_req->t_queue = rts_stats_clock();
+	priv_req->t_start = 0;
+	if (priv_ep->queue_depth > priv_ep->stats.queue_hwm)
+		priv_ep->stats.queue_hwm = priv_ep->queue_depth;
+}
+
+/* an interrupt endpoint request may take several starts, count the first */
+static void rts_stats_start(struct rts_endpoint *priv_ep,
+			    struct rts_request *priv_req)
+{
+	struct rts_ep_stats *st = &priv_ep->stats;
+	u64 now, missed;
+
+	if (priv_req->t_start)
+		return;
+
+	now = rts_stats_clock();
+	priv_req->t_start = now;
+	rts_hist_add(st->queue_hist, now - priv_req->t_queue);
+
+	if (!st->idle)
+		return;
+	st->idle = false;
+	missed = div64_u64(now - st->t_idle, priv_ep->interval_ns);
+	if (missed) {
+		st->iso_missed += missed;
+		trace_rts_iso_missed(priv_ep, now - st->t_idle, missed);
+	}
+}
+
+/*
+ * Called once @priv_req is off the queue. An iso in endpoint with nothing
+ * queued behind a completed request has nothing for the next service
+ * interval; count that and time the gap until the next start.
+ */
+static void rts_stats_done(struct rts_endpoint *priv_ep,
+			   struct rts_request *priv_req)
+{
+	struct rts_ep_stats *st = &priv_ep->stats;
+	u64 now = rts_stats_clock();
+
+	if (priv_req->request.status) {
+		st->errors++;
+		return;
+	}
+
+	st->requests++;
+	st->bytes += priv_req->request.actual;
+	if (priv_req->t_start)
+		rts_hist_add(st->xfer_hist, now - priv_req->t_start);
+
+	if (priv_ep->interval_ns && priv_ep->dir_in &&
+	    list_empty(&priv_ep->queue)) {
+		st->iso_underrun++;
+		st->idle = true;
+		st->t_idle = now;
+		trace_rts_iso_underrun(priv_ep, priv_req);
+	}
+}
+
+static inline void rts_stats_irq_wake(struct rts_udc *rtsusb)
+{
+	rtsusb->t_irq = rts_stats_clock();
+}
+
+static inline void rts_stats_thread(struct rts_udc *rtsusb)
+{
+	rts_hist_add(rtsusb->thread_hist, rts_stats_clock() - rtsusb->t_irq);
+}
+
+/* Bucket 0 holds zero, bucket n holds [2^(n-1), 2^n) */
+static void rts_show_hist(struct seq_file *s, const char *name,
+			  const char *unit, const u32 *hist)
+{
+	int i;
+
+	seq_printf(s, "  %s:\n", name);
+	for (i = 0; i < RTS_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (!i)
+			seq_printf(s, "    %12u %s: %u\n", 0, unit, hist[i]);
+		else if (i == RTS_HIST_BUCKETS - 1)
+			seq_printf(s, "   >%12u %s: %u\n", 1U << (i - 1), unit,
+				   hist[i]);
+		else
+			seq_printf(s, "   <%12u %s: %u\n", 1U << i, unit,
+				   hist[i]);
+	}
+}
+
+static void rts_show_ep_stats(struct seq_file *s, struct rts_endpoint *priv_ep)
+{
+	struct rts_ep_stats *st = &priv_ep->stats;
+
+	if (!priv_ep->ep_enable && !st->requests && !st->errors)
+		return;
+
+	seq_printf(s, "%s mc%u: requests %llu bytes %llu errors %u depth %u hwm %u pool %u\n",
+		   priv_ep->endpoint.name, priv_ep->mcnum, st->requests,
+		   st->bytes, st->errors, priv_ep->queue_depth, st->queue_hwm,
+		   priv_ep->req_pool_cnt);
+	if (priv_ep->interval_ns)
+		seq_printf(s, "  iso: interval %llu ns underruns %u missed %u\n",
+			   priv_ep->interval_ns, st->iso_underrun,
+			   st->iso_missed);
+	if (priv_ep->fifo_not_drained)
+		seq_printf(s, "  fifo drain: waits %u timeouts %u total %llu ns max %llu ns\n",
+			   priv_ep->fifo_not_drained,
+			   priv_ep->fifo_drain_timeout, priv_ep->fifo_drain_ns,
+			   priv_ep->fifo_drain_max_ns);
+	rts_show_hist(s, "queue to start", "ns", st->queue_hist);
+	rts_show_hist(s, "start to done", "ns", st->xfer_hist);
+}
+
+static int rts_stats_show(struct seq_file *s, void *unused)
+{
+	struct rts_udc *rtsusb = s->private;
+	int i;
+
+	for (i = 0; i < RTS_EP_IN_MAX_COUNT; i++)
+		rts_show_ep_stats(s, rtsusb->ep_in[i]);
+	for (i = 1; i < RTS_EP_OUT_MAX_COUNT; i++)
+		rts_show_ep_stats(s, rtsusb->ep_out[i]);
+
+	seq_printf(s, "ep0 cache hits: %u\n", rtsusb->ep0_cache_hits);
+	seq_puts(s, "interrupts:\n");
+	for (i = 0; i < RTS_IRQ_SRC_MAX; i++)
+		seq_printf(s, "  %-8s %u\n", rts_irq_src_names[i],
+			   rtsusb->irq_count[i]);
+	rts_show_hist(s, "irq to thread", "ns", rtsusb->thread_hist);
+	return 0;
+}
+
+static int rts_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rts_stats_show, inode->i_private);
+}
+
+static void rts_clear_ep_stats(struct rts_endpoint *priv_ep)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(rts_ep_lock(priv_ep), flags);
+	memset(&priv_ep->stats, 0, sizeof(priv_ep->stats));
+	priv_ep->fifo_not_drained = 0;
+	priv_ep->fifo_drain_timeout = 0;
+	priv_ep->fifo_drain_ns = 0;
+	priv_ep->fifo_drain_max_ns = 0;
+	spin_unlock_irqrestore(rts_ep_lock(priv_ep), flags);
+}
+
+/* Any write clears the statistics */
+static ssize_t rts_stats_write(struct file *file, const char __user *user_buf,
+			       size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct rts_udc *rtsusb = s->private;
+	int i;
+
+	for (i = 0; i < RTS_EP_IN_MAX_COUNT; i++)
+		rts_clear_ep_stats(rtsusb->ep_in[i]);
+	for (i = 1; i < RTS_EP_OUT_MAX_COUNT; i++)
+		rts_clear_ep_stats(rtsusb->ep_out[i]);
+	memset(rtsusb->irq_count, 0, sizeof(rtsusb->irq_count));
+	rtsusb->ep0_cache_hits = 0;
+	memset(rtsusb->thread_hist, 0, sizeof(rtsusb->thread_hist));
+	return count;
+}
+
+static const struct file_operations rts_stats_ops = {
+	.owner		= THIS_MODULE,
+	.open		= rts_stats_open,
+	.read		= seq_read,
+	.write		= rts_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void rts_usb_debugfs_init(struct rts_udc *rtsusb)
+{
+	rtsusb->debugfs = debugfs_create_dir(dev_name(rtsusb->dev), NULL);
+	debugfs_create_file("stats", S_IFREG | S_IRUGO | S_IWUSR,
+			    rtsusb->debugfs, rtsusb, &rts_stats_ops);
+}
+
+static void rts_usb_debugfs_remove(struct rts_udc *rtsusb)
+{
+	debugfs_remove_recursive(rtsusb->debugfs);
+}
+#else
+static inline void rts_stats_queue(struct rts_endpoint *priv_ep,
+				   struct rts_request *priv_req)
+{
+}
+
+static inline void rts_stats_start(struct rts_endpoint *priv_ep,
+				   struct rts_request *priv_req)
+{
+}
+
+static inline void rts_stats_done(struct rts_endpoint *priv_ep,
+				  struct rts_request *priv_req)
+{
+}
+
+static inline void rts_stats_irq_wake(struct rts_udc *rtsusb)
+{
+}
+
+static inline void rts_stats_thread(struct rts_udc *rtsusb)
+{
+}
+
+static inline void rts_usb_debugfs_init(struct rts_udc *rtsusb)
+{
+}
+
+static inline void rts_usb_debugfs_remove(struct rts_udc *rtsusb)
+{
+}
+#endif /* CONFIG_DEBUG_FS */
+
+/*
+ * rts_uac_fill_ring
+ * The uac in packet size table is consumed in order, one entry per MC FIFO
+ * transfer. Give every queued request its entry as soon as a slot is free
+ * instead of at DMA start, and write each touched register once from the
+ * shadow copy.
+ */
+static void rts_uac_fill_ring(struct rts_endpoint *priv_ep)
+{
+	struct rts_request *priv_req;
+	unsigned long dirty = 0;
+	u32 len;
+	int i;
+
+	list_for_each_entry(priv_req, &priv_ep->queue, queue) {
+		if (priv_ep->uac_filled == RTS_UAC_RING_SIZE)
+			break;
+		if (priv_req->uac_slotted)
+			continue;
+
+		i = priv_ep->uac_cnt / 2;
+		len = priv_req->request.length & 0x7ff;
+		if (priv_ep->uac_cnt % 2 == 0) {
+			priv_ep->uac_pktsize[i] &= ~UACIN_PKTSIZE010_0_MASK;
+			priv_ep->uac_pktsize[i] |=
+				len << UACIN_PKTSIZE010_0_OFFSET;
+		} else {
+			priv_ep->uac_pktsize[i] &= ~UACIN_PKTSIZE110_0_MASK;
+			priv_ep->uac_pktsize[i] |=
+				len << UACIN_PKTSIZE110_0_OFFSET;
+		}
+		__set_bit(i, &dirty);
+
+		priv_req->uac_slot = priv_ep->uac_cnt;
+		priv_req->uac_slotted = true;
+		priv_ep->uac_filled++;
+		if (++priv_ep->uac_cnt == RTS_UAC_RING_SIZE)
+			priv_ep->uac_cnt = 0;
+	}
+
+	for_each_set_bit(i, &dirty, RTS_UAC_RING_REGS)
+		usb_write_reg(priv_ep->uac_pktsize[i],
+			      USB_UACINEP_PKTSIZE0 + i * 4);
+}
+
+/*
+ * rts_uac_release_slot
+ * Called before @priv_req leaves the queue. The head request's entry has
+ * been consumed by the hardware. A request dequeued from further back
+ * leaves a hole, so rewind to its slot and let the next fill rewrite the
+ * requests behind it.
+ */
+static void rts_uac_release_slot(struct rts_endpoint *priv_ep,
+				 struct rts_request *priv_req)
+{
+	struct rts_request *next = priv_req;
+
+	if (list_first_entry(&priv_ep->queue, struct rts_request, queue) ==
+	    priv_req) {
+		priv_req->uac_slotted = false;
+		priv_ep->uac_filled--;
+		return;
+	}
+
+	priv_ep->uac_cnt = priv_req->uac_slot;
+	list_for_each_entry_from(next, &priv_ep->queue, queue) {
+		if (!next->uac_slotted)
+			break;
+		next->uac_slotted = false;
+		priv_ep->uac_filled--;
+	}
+}
+
 static void rts_done(struct rts_endpoint *priv_ep, struct rts_request *priv_req,
 		     int status)
 {
@@ -665,6 +1088,8 @@ static void rts_done(struct rts_endpoint *priv_ep, struct rts_request *priv_req,
 
 	RTS_DEBUG("%s() ep %d\n", __func__, priv_ep->epnum);
 
+	if (priv_req->uac_slotted)
+		rts_uac_release_slot(priv_ep, priv_req);
 	list_del_init(&priv_req->queue);
 
 	priv_ep->stopped = 1;
@@ -675,6 +1100,10 @@ static void rts_done(struct rts_endpoint *priv_ep, struct rts_request *priv_req,
 	else
 		priv_req->request.status = status;
 
+	priv_ep->queue_depth--;
+	rts_stats_done(priv_ep, priv_req);
+	trace_rts_ep_done(priv_ep, priv_req);
+
 	if (priv_ep->epnum) { /* not ep0 */
 		if (list_empty(&priv_ep->queue)) {
 			RTS_DEBUG("ep%d->queue is empty", priv_ep->epnum);
@@ -700,12 +1129,11 @@ static void rts_done(struct rts_endpoint *priv_ep, struct rts_request *priv_req,
 		usb_gadget_unmap_request(&priv_ep->rts_dev->gadget,
 					 &priv_req->request, priv_ep->dir_in);
 
-	spin_unlock(&priv_ep->rts_dev->lock);
+	spin_unlock(rts_ep_lock(priv_ep));
 	usb_gadget_giveback_request(&priv_ep->endpoint, &priv_req->request);
-	spin_lock(&priv_ep->rts_dev->lock);
+	spin_lock(rts_ep_lock(priv_ep));
 
-	if (priv_ep->rts_dev->request_pending > 0)
-		--priv_ep->rts_dev->request_pending;
+	atomic_dec_if_positive(&priv_ep->rts_dev->request_pending);
 	priv_ep->stopped = stopped;
 }
 
@@ -714,13 +1142,13 @@ static void rts_done_uvc_in_disable(struct rts_endpoint *priv_ep)
 	struct rts_request *priv_req;
 	unsigned long flags;
 
-	spin_lock_irqsave(&priv_ep->rts_dev->lock, flags);
+	spin_lock_irqsave(&priv_ep->lock, flags);
 	while (!list_empty(&priv_ep->queue)) {
 		priv_req = list_entry(priv_ep->queue.next,
 				      struct rts_request, queue);
-		rts_done_wq(priv_ep, priv_req, -ECONNRESET);
+		rts_done(priv_ep, priv_req, -ECONNRESET);
 	}
-	spin_unlock_irqrestore(&priv_ep->rts_dev->lock, flags);
+	spin_unlock_irqrestore(&priv_ep->lock, flags);
 
 	priv_ep->epnum = 0;
 	priv_ep->mcnum = 0;
@@ -729,6 +1157,7 @@ static void rts_done_uvc_in_disable(struct rts_endpoint *priv_ep)
 	priv_ep->stopped = 0;
 	priv_ep->ep_enable = 0;
 	priv_ep->uac_cnt = 0;
+	priv_ep->uac_filled = 0;
 	priv_ep->is_uac_in = 0;
 }
 
@@ -757,46 +1186,55 @@ static int rts_ep_disable(struct usb_ep *ep)
 {
 	struct rts_endpoint *priv_ep;
 	struct rts_request *priv_req;
+	struct rts_udc *rtsusb;
+	struct rts_mcm *m;
 	unsigned long flags;
-	int i;
 
 	RTS_DEBUG("%s()\n", __func__);
 
 	WARN_ON(!ep);
 
 	priv_ep = ep_to_rts_ep(ep);
+	rtsusb = priv_ep->rts_dev;
+	if (priv_ep == rtsusb->ep_in[0])
+		return -EINVAL;
+
+	hrtimer_cancel(&priv_ep->drain_timer);
+
+	spin_lock_irqsave(&priv_ep->lock, flags);
+	priv_ep->drain_pending = 0;
 
 	rts_set_ep_disable(priv_ep, priv_ep->epnum);
 
-	for (i = 0; i < RTS_MCM_MAX_COUNT; i++) {
-		if (mcm[i]->epnum == priv_ep->epnum &&
-		    mcm[i]->dir_in == priv_ep->dir_in &&
-		    mcm[i]->dir_out == priv_ep->dir_out) {
-			mcm[i]->epnum = 0;
-			mcm[i]->claimed = 0;
-			mcm[i]->dir_in = 0;
-			mcm[i]->dir_out = 0;
-		}
+	/* give the MC FIFO taken in rts_set_ep_fifo_mapping() back */
+	spin_lock(&rtsusb->lock);
+	m = mcm[priv_ep->mcnum];
+	if (m->claimed && m->epnum == priv_ep->epnum &&
+	    m->dir_in == priv_ep->dir_in && m->dir_out == priv_ep->dir_out) {
+		m->epnum = 0;
+		m->claimed = 0;
+		m->dir_in = 0;
+		m->dir_out = 0;
 	}
+	spin_unlock(&rtsusb->lock);
 
 	if (priv_ep->epnum == 5 || priv_ep->epnum == 6) {
-		struct rts_udc *rtsusb = priv_ep->rts_dev;
-
 		queue_work(rtsusb->udc_wq,
 			   &rtsusb->uvcin_done_work[priv_ep->epnum - 5]);
+		spin_unlock_irqrestore(&priv_ep->lock, flags);
 		return 0;
 	}
 
 	while (!list_empty(&priv_ep->queue)) {
 		priv_req = list_entry(priv_ep->queue.next,
 					struct rts_request, queue);
-		spin_lock_irqsave(&priv_ep->rts_dev->lock, flags);
 		rts_done(priv_ep, priv_req, -ECONNRESET);
-		spin_unlock_irqrestore(&priv_ep->rts_dev->lock, flags);
 	}
 
-	if (!priv_ep->epnum)
+	if (!priv_ep->epnum) {
+		spin_unlock_irqrestore(&priv_ep->lock, flags);
 		return 0;
+	}
 	priv_ep->epnum = 0;
 	priv_ep->mcnum = 0;
 	priv_ep->stall = 0;
@@ -804,7 +1242,9 @@ static int rts_ep_disable(struct usb_ep *ep)
 	priv_ep->stopped = 0;
 	priv_ep->ep_enable = 0;
 	priv_ep->uac_cnt = 0;
+	priv_ep->uac_filled = 0;
 	priv_ep->is_uac_in = 0;
+	spin_unlock_irqrestore(&priv_ep->lock, flags);
 	return 0;
 }
 
@@ -818,11 +1258,25 @@ static int rts_ep_disable(struct usb_ep *ep)
 static struct usb_request *rts_ep_alloc_request(struct usb_ep *ep,
 						gfp_t gfp_flags)
 {
-	struct rts_request *priv_req;
+	struct rts_endpoint *priv_ep = ep_to_rts_ep(ep);
+	struct rts_request *priv_req = NULL;
+	unsigned long flags;
 
 	RTS_DEBUG("%s()\n", __func__);
 
-	priv_req = kzalloc(sizeof(*priv_req), gfp_flags);
+	spin_lock_irqsave(rts_ep_lock(priv_ep), flags);
+	if (!list_empty(&priv_ep->req_pool)) {
+		priv_req = list_first_entry(&priv_ep->req_pool,
+					    struct rts_request, queue);
+		list_del(&priv_req->queue);
+		priv_ep->req_pool_cnt--;
+	}
+	spin_unlock_irqrestore(rts_ep_lock(priv_ep), flags);
+
+	if (priv_req)
+		memset(priv_req, 0, sizeof(*priv_req));
+	else
+		priv_req = kzalloc(sizeof(*priv_req), gfp_flags);
 	if (!priv_req)
 		return NULL;
 
@@ -837,9 +1291,21 @@ static struct usb_request *rts_ep_alloc_request(struct usb_ep *ep,
  */
 static void rts_ep_free_request(struct usb_ep *ep, struct usb_request *request)
 {
+	struct rts_endpoint *priv_ep = ep_to_rts_ep(ep);
 	struct rts_request *priv_req = to_rts_request(request);
+	unsigned long flags;
 
 	RTS_DEBUG("%s()\n", __func__);
+
+	/* keep a few request objects per endpoint for the next stream */
+	spin_lock_irqsave(rts_ep_lock(priv_ep), flags);
+	if (priv_ep->req_pool_cnt < RTS_REQ_POOL_MAX) {
+		list_add(&priv_req->queue, &priv_ep->req_pool);
+		priv_ep->req_pool_cnt++;
+		priv_req = NULL;
+	}
+	spin_unlock_irqrestore(rts_ep_lock(priv_ep), flags);
+
 	kfree(priv_req);
 }
 
@@ -865,7 +1331,7 @@ static void rts_start_ep0_transfer(struct rts_endpoint *priv_ep,
 		if (length > priv_ep->endpoint.maxpacket)
 			length = priv_ep->endpoint.maxpacket;
 		RTS_DEBUG("ep0 in length %d\n", length);
-		for (i = 0; i <= (length - 1) / 4; i++, buffer++)
+		for (i = 0; length && i <= (length - 1) / 4; i++, buffer++)
 			mc_write_reg(*buffer, EP0_BASE + i * 4);
 
 		mc_write_reg(length & 0xff, R_EP0_MC_BUF_BC);
@@ -878,13 +1344,81 @@ static void rts_start_ep0_transfer(struct rts_endpoint *priv_ep,
 	}
 }
 
+static bool rts_ep0_cacheable(const struct usb_ctrlrequest *ctrl)
+{
+	return ep0_cache &&
+	       ctrl->bRequestType == (USB_DIR_IN | USB_TYPE_CLASS |
+				      USB_RECIP_INTERFACE) &&
+	       ctrl->bRequest >= 0x81 && ctrl->bRequest <= 0x87 &&
+	       ctrl->wLength;
+}
+
+static void rts_ep0_cache_invalidate(struct rts_udc *rtsusb, int intf)
+{
+	int i;
+
+	for (i = 0; i < RTS_EP0_CACHE_SLOTS; i++)
+		if (intf < 0 ||
+		    (rtsusb->ep0_cache[i].setup.wIndex & 0xff) == intf)
+			rtsusb->ep0_cache[i].valid = false;
+}
+
+/* snapshot the function driver's reply to a cacheable setup */
+static void rts_ep0_cache_store(struct rts_udc *rtsusb,
+				struct rts_request *priv_req)
+{
+	struct rts_ep0_cache *ec;
+	unsigned int len = priv_req->request.length;
+
+	rtsusb->ep0_cache_pending = false;
+	if (len > RTS_EP0_CACHE_DATA)
+		return;
+
+	ec = &rtsusb->ep0_cache[rtsusb->ep0_cache_next];
+	rtsusb->ep0_cache_next = (rtsusb->ep0_cache_next + 1) %
+				 RTS_EP0_CACHE_SLOTS;
+	ec->setup = *rtsusb->setup_buf;
+	ec->len = len;
+	memcpy(ec->data, priv_req->request.buf, len);
+	ec->valid = true;
+}
+
+/*
+ * A snapshot answers a setup with the same request, value and index. The
+ * reply may have been cut short by a smaller wLength, in which case only
+ * requests asking for no more than that can use it.
+ */
+static struct rts_ep0_cache *rts_ep0_cache_lookup(struct rts_udc *rtsusb,
+					const struct usb_ctrlrequest *ctrl)
+{
+	struct rts_ep0_cache *ec;
+	int i;
+
+	for (i = 0; i < RTS_EP0_CACHE_SLOTS; i++) {
+		ec = &rtsusb->ep0_cache[i];
+		if (ec->valid &&
+		    ec->setup.bRequest == ctrl->bRequest &&
+		    ec->setup.wValue == ctrl->wValue &&
+		    ec->setup.wIndex == ctrl->wIndex &&
+		    (ec->len < ec->setup.wLength ||
+		     ctrl->wLength <= ec->setup.wLength))
+			return ec;
+	}
+	return NULL;
+}
+
 static int rts_ep0_queue(struct rts_endpoint *priv_ep,
 			 struct rts_request *priv_req)
 {
+	struct rts_udc *rtsusb = priv_ep->rts_dev;
 	int ret = 0;
 
 	RTS_DEBUG("%s()\n", __func__);
 
+	if (rtsusb->ep0_cache_pending && priv_ep->dir_in &&
+	    &priv_req->request != rtsusb->ep0_req)
+		rts_ep0_cache_store(rtsusb, priv_req);
+
 	if (!priv_req->request.length) { /// 这里是wLength为0进入，就不需要setup stage中的data传输阶段了
 		rts_done(priv_ep, priv_req, 0);
 		return ret;
@@ -898,26 +1432,23 @@ static int rts_ep0_queue(struct rts_endpoint *priv_ep,
 static void rts_uvc_quirks(struct rts_endpoint *priv_ep,
 			struct rts_request *priv_req)
 {
-	int pid = priv_ep->pid;
-	u16 maxpid = (priv_ep->desc->wMaxPacketSize >> 11) & 0x3;
-	int maxpkt = priv_ep->maxpkt;
-	int ep_maxpkt = priv_ep->desc->wMaxPacketSize & 0x7FF;
+	const struct rts_uvc_plan *plan = &priv_ep->uvc_plan;
+	u32 len = priv_req->request.length;
+	int bucket = RTS_UVC_SHORT;
+	u16 maxpkt;
+	int pid;
 
 	if (priv_ep->epnum != 5 && priv_ep->epnum != 6)
 		return;
 
-	if (pid > maxpid)
-		pid = maxpid;
-	if (priv_req->request.length > (ep_maxpkt - 12) * (maxpid + 1)) {
-		pid = maxpid;
-		maxpkt = ep_maxpkt;
-	} else {
-		pid = 0;
-		if (priv_req->request.length < (priv_ep->maxpkt - 12)
-			* (pid + 1))
-			maxpkt = 12 + rounddown(
-				priv_req->request.length - 1, 4);
-	}
+	while (len > plan->limit[bucket])
+		bucket++;
+
+	pid = plan->pid[bucket];
+	maxpkt = plan->maxpkt[bucket];
+	if (!maxpkt)
+		maxpkt = 12 + rounddown(len ? len - 1 : 0, 4);
+
 	if (maxpkt != priv_ep->maxpkt)
 		rts_set_ep_maxpkt(priv_ep, maxpkt);
 
@@ -934,11 +1465,28 @@ static void rts_uvc_quirks(struct rts_endpoint *priv_ep,
 	}
 }
 
-static inline void rts_usb_write_header_len(u32 len, unsigned char epnum)
+/*
+ * rts_usb_write_header_len
+ * The uvc endpoints insert the payload header themselves. With meta_len 0
+ * the controller builds the standard 12 byte header from UVC_HEAD (EOH,
+ * SCR, PTS) on every packet, so a function driver can queue a raw frame
+ * buffer as is, without copying it behind a header. A non-zero meta_len
+ * programs a (meta_len + 12) byte header instead.
+ *
+ * Streams keep the same header length for every frame, so the shared
+ * USB_DUMMY0 is only rewritten when it changes.
+ */
+static inline void rts_usb_write_header_len(struct rts_endpoint *priv_ep,
+					    u32 len)
 {
+	struct rts_udc *rtsusb = priv_ep->rts_dev;
+	unsigned char epnum = priv_ep->epnum;
 	u32 val, reg_read;
 
-	if (epnum == 5 || epnum == 6) {
+	if ((epnum == 5 || epnum == 6) && priv_ep->hdr_len != len) {
+		priv_ep->hdr_len = len;
+		/* USB_DUMMY0 is shared by ep5 and ep6 */
+		spin_lock(&rtsusb->lock);
 		reg_read = usb_read_reg(USB_DUMMY0);
 		if (len > 0) {
 			if (epnum == 5) {
@@ -956,6 +1504,7 @@ static inline void rts_usb_write_header_len(u32 len, unsigned char epnum)
 				val = reg_read & 0xFFFFBFFF;
 		}
 		usb_write_reg(val, USB_DUMMY0);
+		spin_unlock(&rtsusb->lock);
 	}
 }
 
@@ -970,22 +1519,12 @@ static void rts_start_dma_transfer(struct rts_endpoint *priv_ep,
 	if (rtsusb->devtype_data->quirks & UDC_QUIRK_DYNAMIC_MAXPKTSIZE)
 		rts_uvc_quirks(priv_ep, priv_req);
 
-	if (priv_ep->is_uac_in) {
-		if (priv_ep->uac_cnt % 2 == 0)
-			usb_write_reg_mask((priv_req->request.length & 0x7ff) <<
-				UACIN_PKTSIZE010_0_OFFSET,
-				USB_UACINEP_PKTSIZE0 + priv_ep->uac_cnt * 2,
-				UACIN_PKTSIZE010_0_MASK);
-		else if (priv_ep->uac_cnt % 2 == 1)
-			usb_write_reg_mask((priv_req->request.length & 0x7ff) <<
-				UACIN_PKTSIZE110_0_OFFSET,
-				USB_UACINEP_PKTSIZE0 +
-				(priv_ep->uac_cnt - 1) * 2,
-				UACIN_PKTSIZE110_0_MASK);
-		priv_ep->uac_cnt++;
-		if (priv_ep->uac_cnt == 20)
-			priv_ep->uac_cnt = 0;
-	}
+	/* normally prefilled at queue time, covers a rewind by dequeue */
+	if (priv_ep->is_uac_in && !priv_req->uac_slotted)
+		rts_uac_fill_ring(priv_ep);
+
+	rts_stats_start(priv_ep, priv_req);
+	trace_rts_ep_start(priv_ep, priv_req);
 
 	mc_write_reg(1, MC_FIFO0_CTRL + 0x100 * priv_ep->mcnum);
 	mc_write_reg(priv_req->request.dma,
@@ -1000,7 +1539,7 @@ static void rts_start_dma_transfer(struct rts_endpoint *priv_ep,
 		mc_clr_reg_bit(U_PE_TRANS_DIR_OFFSET,
 			       MC_FIFO0_DMA_CTRL + 0x100 * priv_ep->mcnum);
 
-	rts_usb_write_header_len(priv_req->request.meta_len, priv_ep->epnum);
+	rts_usb_write_header_len(priv_ep, priv_req->request.meta_len);
 	mc_set_reg_bit(U_PE_TRANS_EN_OFFSET,
 		       MC_FIFO0_DMA_CTRL + 0x100 * priv_ep->mcnum);
 
@@ -1021,6 +1560,9 @@ static void rts_start_intr_transfer(struct rts_endpoint *priv_ep,
 
 	RTS_DEBUG("%s() -> ep%d\n", __func__, priv_ep->epnum);
 
+	rts_stats_start(priv_ep, priv_req);
+	trace_rts_ep_start(priv_ep, priv_req);
+
 	if (priv_ep->dir_in) {
 		buffer = priv_req->request.buf + priv_req->request.actual;
 		length = priv_req->request.length - priv_req->request.actual;
@@ -1042,6 +1584,64 @@ static void rts_start_intr_transfer(struct rts_endpoint *priv_ep,
 	}
 }
 
+/*
+ * __rts_ep_queue
+ * Map and link one request, starting it if the endpoint was idle. Called
+ * with the endpoint lock held. The uac in packet size table is left to the
+ * caller so a batch is written out once.
+ */
+static int __rts_ep_queue(struct rts_endpoint *priv_ep,
+			  struct rts_request *priv_req)
+{
+	int req = 0, ret = 0;
+
+	/*
+	 * Map before the request becomes visible on the queue, the completion
+	 * path may chain it onto the MC FIFO as soon as it is linked.
+	 */
+	if ((priv_ep->epnum > 0 && priv_ep->epnum < 7 && priv_ep->dir_in)
+			|| (priv_ep->epnum && priv_ep->dir_out)) {
+		ret = usb_gadget_map_request(&priv_ep->rts_dev->gadget,
+					     &priv_req->request,
+					     priv_ep->dir_in);
+		if (ret)
+			return ret;
+	}
+
+	if (list_empty(&priv_ep->queue)) {
+		RTS_DEBUG("ep %d list empty\n", priv_ep->epnum);
+		req = 1;
+	}
+
+	priv_req->uac_slotted = false;
+	list_add_tail(&priv_req->queue, &priv_ep->queue);
+	atomic_inc(&priv_ep->rts_dev->request_pending);
+
+	priv_req->request.actual = 0;
+	priv_req->request.status = -EINPROGRESS;
+
+	priv_ep->queue_depth++;
+	rts_stats_queue(priv_ep, priv_req);
+	trace_rts_ep_queue(priv_ep, priv_req);
+
+	if (!priv_ep->epnum) /* ep0 */
+		ret = rts_ep0_queue(priv_ep, priv_req);
+	else if (req && !priv_ep->stall)
+		rts_set_ep_irq_enable(priv_ep);
+
+	if ((priv_ep->epnum > 0 && priv_ep->epnum < 7 && priv_ep->dir_in)
+			|| (priv_ep->epnum && priv_ep->dir_out)) {
+		if (req && !priv_ep->stall && !priv_ep->stopped &&
+		    !priv_ep->drain_pending)
+			rts_start_dma_transfer(priv_ep, priv_req);
+	} else if (priv_ep->epnum > 6 && priv_ep->dir_in) { //intr ep
+		if (req && !priv_ep->stall && !priv_ep->stopped)
+			rts_start_intr_transfer(priv_ep, priv_req);
+	}
+
+	return ret;
+}
+
 /**
  * rts_ep_queue Transfer data on endpoint
  * @ep: pointer to endpoint zero object
@@ -1056,43 +1656,55 @@ static int rts_ep_queue(struct usb_ep *ep, struct usb_request *request,
 	struct rts_endpoint *priv_ep = ep_to_rts_ep(ep);
 	struct rts_request *priv_req = to_rts_request(request);
 	unsigned long flags;
-	int req = 0, ret = 0;
+	int ret;
 
 	RTS_DEBUG("%s() ep%d in %d out %d\n", __func__, priv_ep->epnum,
 		  priv_ep->dir_in, priv_ep->dir_out);
 
-	spin_lock_irqsave(&priv_ep->rts_dev->lock, flags);
-
-	if (list_empty(&priv_ep->queue)) {
-		RTS_DEBUG("ep %d list empty\n", priv_ep->epnum);
-		req = 1;
-	}
-
-	list_add_tail(&priv_req->queue, &priv_ep->queue);
-	++priv_ep->rts_dev->request_pending;
+	spin_lock_irqsave(rts_ep_lock(priv_ep), flags);
+	ret = __rts_ep_queue(priv_ep, priv_req);
+	if (priv_ep->is_uac_in)
+		rts_uac_fill_ring(priv_ep);
+	spin_unlock_irqrestore(rts_ep_lock(priv_ep), flags);
 
-	priv_req->request.actual = 0;
-	priv_req->request.status = -EINPROGRESS;
+	return ret;
+}
 
-	if (!priv_ep->epnum) /* ep0 */
-		ret = rts_ep0_queue(priv_ep, priv_req);
-	else if (req && !priv_ep->stall)
-		rts_set_ep_irq_enable(priv_ep);
+/**
+ * rts_ep_queue_many Transfer several requests on endpoint
+ * @ep: pointer to endpoint object
+ * @reqs: requests, queued in array order
+ * @count: number of requests
+ * @gfp_flags: gfp flags
+ *
+ * Links the whole batch under one endpoint lock acquisition. Returns the
+ * number of requests queued; the first refused one carries the error in
+ * its status.
+ */
+static int rts_ep_queue_many(struct usb_ep *ep, struct usb_request **reqs,
+			     unsigned int count, gfp_t gfp_flags)
+{
+	struct rts_endpoint *priv_ep = ep_to_rts_ep(ep);
+	unsigned long flags;
+	unsigned int i;
+	int ret;
 
-	if ((priv_ep->epnum > 0 && priv_ep->epnum < 7 && priv_ep->dir_in)
-			|| (priv_ep->epnum && priv_ep->dir_out)) {
-		ret = usb_gadget_map_request(&priv_ep->rts_dev->gadget, request,
-					     priv_ep->dir_in);
-		if (req && !priv_ep->stall && !priv_ep->stopped)
-			rts_start_dma_transfer(priv_ep, priv_req);
-	} else if (priv_ep->epnum > 6 && priv_ep->dir_in) { //intr ep
-		if (req && !priv_ep->stall && !priv_ep->stopped)
-			rts_start_intr_transfer(priv_ep, priv_req);
-	}
+	RTS_DEBUG("%s() ep%d in %d out %d count %u\n", __func__,
+		  priv_ep->epnum, priv_ep->dir_in, priv_ep->dir_out, count);
 
-	spin_unlock_irqrestore(&priv_ep->rts_dev->lock, flags);
+	spin_lock_irqsave(rts_ep_lock(priv_ep), flags);
+	for (i = 0; i < count; i++) {
+		ret = __rts_ep_queue(priv_ep, to_rts_request(reqs[i]));
+		if (ret) {
+			reqs[i]->status = ret;
+			break;
+		}
+	}
+	if (priv_ep->is_uac_in)
+		rts_uac_fill_ring(priv_ep);
+	spin_unlock_irqrestore(rts_ep_lock(priv_ep), flags);
 
-	return ret;
+	return i;
 }
 
 static int rts_ep_dequeue(struct usb_ep *ep, struct usb_request *request)
@@ -1103,10 +1715,10 @@ static int rts_ep_dequeue(struct usb_ep *ep, struct usb_request *request)
 
 	RTS_DEBUG("%s()\n", __func__);
 
-	spin_lock_irqsave(&priv_ep->rts_dev->lock, flags);
+	spin_lock_irqsave(rts_ep_lock(priv_ep), flags);
 	if (!list_empty(&priv_ep->queue))
 		rts_done(priv_ep, priv_req, -ECONNRESET);
-	spin_unlock_irqrestore(&priv_ep->rts_dev->lock, flags);
+	spin_unlock_irqrestore(rts_ep_lock(priv_ep), flags);
 
 	return 0;
 }
@@ -1114,12 +1726,11 @@ static int rts_ep_dequeue(struct usb_ep *ep, struct usb_request *request)
 static int rts_set_halt_and_wedge(struct usb_ep *ep, int value, int wedge)
 {
 	struct rts_endpoint *priv_ep = ep_to_rts_ep(ep);
-	struct rts_udc *rtsusb = priv_ep->rts_dev;
 	unsigned long flags;
 
 	RTS_DEBUG("%s()\n", __func__);
 
-	spin_lock_irqsave(&rtsusb->lock, flags);
+	spin_lock_irqsave(rts_ep_lock(priv_ep), flags);
 
 	if (value) {
 		rts_set_epnstall(priv_ep);
@@ -1136,7 +1747,7 @@ static int rts_set_halt_and_wedge(struct usb_ep *ep, int value, int wedge)
 			rts_set_ep_irq_enable(priv_ep);
 	}
 
-	spin_unlock_irqrestore(&rtsusb->lock, flags);
+	spin_unlock_irqrestore(rts_ep_lock(priv_ep), flags);
 
 	return 0;
 }
@@ -1161,6 +1772,7 @@ static const struct usb_ep_ops rts_ep_ops = {
 	.free_request	= rts_ep_free_request,
 
 	.queue		= rts_ep_queue,
+	.queue_many	= rts_ep_queue_many,
 	.dequeue	= rts_ep_dequeue,
 
 	.set_halt	= rts_ep_set_halt,
@@ -1288,8 +1900,11 @@ static void rts_usb_req_ep0_clear_feature(struct rts_udc *rtsusb,
 				rts_set_cxdone(rtsusb);
 				break;
 			}
-			if (ep->stall)
+			if (ep->stall) {
+				spin_unlock(&rtsusb->lock);
 				rts_set_halt_and_wedge(&ep->endpoint, 0, 0);
+				spin_lock(&rtsusb->lock);
+			}
 		}
 		rts_set_cxdone(rtsusb);
 		break;
@@ -1370,9 +1985,13 @@ static void rts_usb_req_ep0_set_feature(struct rts_udc *rtsusb,
 		else
 			ep = rtsusb->ep_out[epnum];
 
-		if (epnum) /// 这边是设置除ep0之外的ep回应stall，但control transfer的setup事务应该只用在ep0吧???用不到
+		if (epnum) { /// 这边是设置除ep0之外的ep回应stall，但control transfer的setup事务应该只用在ep0吧???用不到
+			spin_unlock(&rtsusb->lock);
+			spin_lock(&ep->lock);
 			rts_set_epnstall(ep);
-		else
+			spin_unlock(&ep->lock);
+			spin_lock(&rtsusb->lock);
+		} else
 			rts_set_cxstall(rtsusb);
 		rts_set_cxdone(rtsusb);
 		}
@@ -1457,6 +2076,11 @@ static int rts_usb_ep0_standard_request(struct rts_udc *rtsusb,
 	case USB_REQ_SET_CONFIGURATION:
 		RTS_DEBUG("\nset_configuration\n");
 		rts_usb_req_ep0_set_configuration(rtsusb, ctrl_req);
+		rts_ep0_cache_invalidate(rtsusb, -1);
+		ret = 1;
+		break;
+	case USB_REQ_SET_INTERFACE:
+		rts_ep0_cache_invalidate(rtsusb, -1);
 		ret = 1;
 		break;
 	default:
@@ -1466,6 +2090,50 @@ static int rts_usb_ep0_standard_request(struct rts_udc *rtsusb,
 	return ret;
 }
 
+/*
+ * rts_usb_ep0_class_request
+ * Returns 0 when the request was answered from ep0_cache[], 1 to pass it
+ * to the gadget driver.
+ */
+static int rts_usb_ep0_class_request(struct rts_udc *rtsusb,
+				     struct usb_ctrlrequest *ctrl_req)
+{
+	struct rts_ep0_cache *ec;
+
+	if (!ep0_cache)
+		return 1;
+
+	if (!(ctrl_req->bRequestType & USB_DIR_IN)) {
+		if ((ctrl_req->bRequestType & USB_RECIP_MASK) ==
+		    USB_RECIP_INTERFACE)
+			rts_ep0_cache_invalidate(rtsusb,
+						 ctrl_req->wIndex & 0xff);
+		return 1;
+	}
+
+	if (!rts_ep0_cacheable(ctrl_req))
+		return 1;
+
+	ec = rts_ep0_cache_lookup(rtsusb, ctrl_req);
+	if (!ec) {
+		rtsusb->ep0_cache_pending = true;
+		return 1;
+	}
+
+	rtsusb->ep0_cache_hits++;
+	rtsusb->ep0_req->buf = ec->data;
+	rtsusb->ep0_req->length = min_t(u16, ec->len, ctrl_req->wLength);
+	/* short reply ending on a packet boundary, as composite_setup() does */
+	rtsusb->ep0_req->zero = rtsusb->ep0_req->length < ctrl_req->wLength &&
+		!(rtsusb->ep0_req->length %
+		  rtsusb->ep_in[0]->endpoint.maxpacket);
+	rtsusb->ep0_req->complete = rts_ep0_req_complete;
+
+	/* the device lock is ep0's endpoint lock, already held here */
+	__rts_ep_queue(rtsusb->ep_in[0], to_rts_request(rtsusb->ep0_req));
+	return 0;
+}
+
 static int rts_usb_setup_process(struct rts_udc *rtsusb)
 {
 	struct usb_ctrlrequest *ctrl = rtsusb->setup_buf;
@@ -1474,10 +2142,14 @@ static int rts_usb_setup_process(struct rts_udc *rtsusb)
 	RTS_DEBUG("%s()\n", __func__);
 
 	rtsusb->ep_in[0]->dir_in = ctrl->bRequestType & USB_DIR_IN;
+	rtsusb->ep0_cache_pending = false;
 	switch (ctrl->bRequestType & USB_TYPE_MASK) { /// USB_TYPE_MASK: 0x60(0110 0000)
 	case USB_TYPE_STANDARD: /// 0x00
 		ret = rts_usb_ep0_standard_request(rtsusb, ctrl);
 		break;
+	case USB_TYPE_CLASS:
+		ret = rts_usb_ep0_class_request(rtsusb, ctrl);
+		break;
 	default:
 		ret = 1;
 		break;
@@ -1519,6 +2191,16 @@ static void rts_ep0_transfer_process(struct rts_endpoint *priv_ep)
 		}
 	}
 
+	/* a short reply ending on a packet boundary needs a ZLP to end it */
+	if (priv_ep->dir_in && priv_req->request.zero &&
+	    priv_req->request.length &&
+	    priv_req->request.length == priv_req->request.actual &&
+	    !(priv_req->request.length % priv_ep->endpoint.maxpacket) &&
+	    priv_req->ep0_in_last_length) {
+		rts_start_ep0_transfer(priv_ep, priv_req);
+		return;
+	}
+
 	if ((priv_req->request.length == priv_req->request.actual)
 	    || (priv_req->request.actual < priv_ep->endpoint.maxpacket))
 		rts_done(priv_ep, priv_req, 0);
@@ -1526,16 +2208,15 @@ static void rts_ep0_transfer_process(struct rts_endpoint *priv_ep)
 		rts_start_ep0_transfer(priv_ep, priv_req);
 }
 
-static int rts_usb_ep0_irq(struct rts_udc *rtsusb)
+static int rts_usb_ep0_irq(struct rts_udc *rtsusb, u32 int_val)
 {
 	int ret = 0;
-	u32 int_val;
 
 	RTS_DEBUG("%s()\n", __func__);
 
-	int_val = (usb_read_reg(USB_IRQ_EN) & usb_read_reg(USB_IRQ_STATUS));
 	RTS_DEBUG("interrupt_val %#x\n", int_val);
 	if (int_val & BIT(I_SETUPF_OFFSET)) { /// setup packet irq
+		rtsusb->irq_count[RTS_IRQ_SETUP]++;
 		usb_set_reg_bit(I_EP0OUTF_OFFSET, USB_IRQ_STATUS); /// clear data packet received irq
 		RTS_DEBUG("\nrecieve setup irq\n");
 
@@ -1563,12 +2244,14 @@ static int rts_usb_ep0_irq(struct rts_udc *rtsusb)
 
 	if (int_val & BIT(I_EP0INF_OFFSET)) {
 		RTS_DEBUG("\nrecieve ep0 in transmitted irq\n");
+		rtsusb->irq_count[RTS_IRQ_EP0_IN]++;
 		usb_set_reg_bit(I_EP0INF_OFFSET, USB_IRQ_STATUS);
 		rts_ep0_transfer_process(rtsusb->ep_in[0]);
 	}
 
 	if (int_val & BIT(I_EP0OUTF_OFFSET)) {
 		RTS_DEBUG("\nrecieve ep0 out received irq\n");
+		rtsusb->irq_count[RTS_IRQ_EP0_OUT]++;
 		usb_set_reg_bit(I_EP0OUTF_OFFSET, USB_IRQ_STATUS);
 		rts_ep0_transfer_process(rtsusb->ep_in[0]);
 	}
@@ -1609,6 +2292,29 @@ static void rts_start_next_request(struct rts_endpoint *priv_ep)
 	}
 }
 
+/*
+ * rts_chain_next_request
+ * Arm the request queued behind @priv_req on the MC FIFO while @priv_req is
+ * still on the queue, so the FIFO does not sit idle for the giveback and the
+ * function driver's re-queue. Returns true if a request was started.
+ */
+static bool rts_chain_next_request(struct rts_endpoint *priv_ep,
+				   struct rts_request *priv_req)
+{
+	struct rts_request *next;
+
+	if (priv_ep->stall || priv_ep->stopped ||
+	    list_is_last(&priv_req->queue, &priv_ep->queue))
+		return false;
+
+	next = list_next_entry(priv_req, queue);
+	RTS_DEBUG("%s() -> ep%d mc%d\n", __func__,
+		  priv_ep->epnum, priv_ep->mcnum);
+	rts_start_dma_transfer(priv_ep, next);
+
+	return true;
+}
+
 static void rts_intr_transfer_process(struct rts_endpoint *priv_ep,
 				      struct rts_request *priv_req)
 {
@@ -1643,34 +2349,95 @@ static void rts_usb_intr_in_process(struct rts_endpoint *priv_ep)
 		rts_intr_transfer_process(priv_ep, priv_req);
 }
 
-static int rts_usb_intrep_irq(struct rts_udc *rtsusb)
+static int rts_usb_intrep_irq(struct rts_udc *rtsusb, int epnum)
 {
+	struct rts_endpoint *priv_ep = rtsusb->ep_in[epnum];
+	int ret = 0;
 	u32 int_val;
-	int epnum;
 
 	RTS_DEBUG("%s()\n", __func__);
 
-	for (epnum = 7; epnum < 13; epnum++) {
-		if (rtsusb->ep_in[epnum]->ep_enable) {
-			int_val = usb_read_reg(USB_INTEREPA_IRQ_STATUS +
-					       (epnum - 7) * 0x80);
-			if (int_val & BIT(I_INTEP_INF_OFFSET)) {
-				RTS_DEBUG("irq: intr ep%d irq val %#x\n",
-				epnum, int_val);
-				rts_usb_intr_in_process(rtsusb->ep_in[epnum]);
-				usb_set_reg_bit(I_INTEP_INF_OFFSET,
-				USB_INTEREPA_IRQ_STATUS + (epnum - 7) * 0x80);
-			}
+	spin_lock(&priv_ep->lock);
+
+	if (!priv_ep->ep_enable)
+		goto out;
+
+	int_val = usb_read_reg(USB_INTEREPA_IRQ_STATUS + (epnum - 7) * 0x80);
+	if (!(int_val & BIT(I_INTEP_INF_OFFSET)))
+		goto out;
+
+	RTS_DEBUG("irq: intr ep%d irq val %#x\n", epnum, int_val);
+	rtsusb->irq_count[RTS_IRQ_INTR_IN]++;
+	rts_usb_intr_in_process(priv_ep);
+	usb_set_reg_bit(I_INTEP_INF_OFFSET,
+			USB_INTEREPA_IRQ_STATUS + (epnum - 7) * 0x80);
+	ret = 1;
+out:
+	spin_unlock(&priv_ep->lock);
+	return ret;
+}
+
+/*
+ * Time for the bytes still in the MC FIFO to go out on the bus, used as
+ * the re-check period while waiting for a bulk in FIFO to drain.
+ */
+static ktime_t rts_fifo_drain_time(struct rts_endpoint *priv_ep, u32 bc)
+{
+	u64 ns;
+
+	if (priv_ep->rts_dev->gadget.speed == USB_SPEED_HIGH)
+		ns = (u64)bc * RTS_HS_BYTE_NS;
+	else
+		ns = (u64)bc * RTS_FS_BYTE_NS;
+
+	return ns_to_ktime(max_t(u64, ns, RTS_FIFO_DRAIN_MIN_NS));
+}
+
+static enum hrtimer_restart rts_fifo_drain_timer(struct hrtimer *timer)
+{
+	struct rts_endpoint *priv_ep = container_of(timer, struct rts_endpoint,
+						    drain_timer);
+	struct rts_udc *rtsusb = priv_ep->rts_dev;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+	u64 waited;
+	u32 bc;
+
+	spin_lock_irqsave(&priv_ep->lock, flags);
+
+	if (!priv_ep->drain_pending)
+		goto out;
+
+	waited = ktime_to_ns(ktime_sub(ktime_get(), priv_ep->drain_start));
+	bc = mc_read_reg(MC_FIFO0_BC + 0x100 * priv_ep->mcnum);
+	if (bc) {
+		if (waited < RTS_FIFO_DRAIN_TIMEOUT_NS) {
+			hrtimer_forward_now(timer,
+					    rts_fifo_drain_time(priv_ep, bc));
+			ret = HRTIMER_RESTART;
+			goto out;
 		}
+		priv_ep->fifo_drain_timeout++;
+		dev_warn_ratelimited(rtsusb->dev,
+				     "ep%din fifo not drained, %u bytes left\n",
+				     priv_ep->epnum, bc);
 	}
 
-	return 0;
+	priv_ep->fifo_drain_ns += waited;
+	if (waited > priv_ep->fifo_drain_max_ns)
+		priv_ep->fifo_drain_max_ns = waited;
+	priv_ep->drain_pending = 0;
+	rts_start_next_request(priv_ep);
+out:
+	spin_unlock_irqrestore(&priv_ep->lock, flags);
+	return ret;
 }
 
 static void rts_usb_bulk_in_process(struct rts_endpoint *priv_ep)
 {
 	struct rts_request *priv_req = NULL;
-	int cnt;
+	bool chained;
+	u32 bc;
 
 	RTS_DEBUG("%s() -> ep%d\n", __func__, priv_ep->epnum);
 
@@ -1680,71 +2447,51 @@ static void rts_usb_bulk_in_process(struct rts_endpoint *priv_ep)
 	priv_req = list_entry(priv_ep->queue.next, struct rts_request, queue);
 	if (priv_req->request.length)
 		rts_transfer_complete(priv_ep, priv_req);
-	rts_done_wq(priv_ep, priv_req, 0);
-	cnt = 10000;
-	while (cnt--) {
-		if (mc_read_reg(MC_FIFO0_BC + 0x100 * priv_ep->mcnum) == 0)
-			break;
-	}
-	rts_start_next_request(priv_ep);
-}
 
-static void rts_usb_bulk_in_process_ep1(struct work_struct *work)
-{
-	struct rts_udc *rtsusb = container_of(work, struct rts_udc,
-					      bulkin_work[0]);
-	struct rts_endpoint *priv_ep = rtsusb->ep_in[1];
-
-	rts_usb_bulk_in_process(priv_ep);
-}
-
-static void rts_usb_bulk_in_process_ep2(struct work_struct *work)
-{
-	struct rts_udc *rtsusb = container_of(work, struct rts_udc,
-					      bulkin_work[1]);
-	struct rts_endpoint *priv_ep = rtsusb->ep_in[2];
-
-	rts_usb_bulk_in_process(priv_ep);
-}
-
-static void rts_usb_bulk_in_process_ep3(struct work_struct *work)
-{
-	struct rts_udc *rtsusb = container_of(work, struct rts_udc,
-					      bulkin_work[2]);
-	struct rts_endpoint *priv_ep = rtsusb->ep_in[3];
+	/*
+	 * The next request must not be armed before the FIFO has drained.
+	 * If it has not, give this one back now and let the drain timer arm
+	 * the next one, rts_ep_queue() holds off while drain_pending is set.
+	 */
+	bc = mc_read_reg(MC_FIFO0_BC + 0x100 * priv_ep->mcnum);
+	if (bc) {
+		priv_ep->fifo_not_drained++;
+		priv_ep->drain_pending = 1;
+		priv_ep->drain_start = ktime_get();
+		hrtimer_start(&priv_ep->drain_timer,
+			      rts_fifo_drain_time(priv_ep, bc),
+			      HRTIMER_MODE_REL);
+		rts_done(priv_ep, priv_req, 0);
+		return;
+	}
 
-	rts_usb_bulk_in_process(priv_ep);
+	chained = rts_chain_next_request(priv_ep, priv_req);
+	rts_done(priv_ep, priv_req, 0);
+	if (!chained)
+		rts_start_next_request(priv_ep);
 }
 
-static int rts_usb_bulkinep_irq(struct rts_udc *rtsusb)
+static int rts_usb_bulkinep_irq(struct rts_udc *rtsusb, int epnum,
+				u32 int_val)
 {
-	u32 int_val;
-	int epnum;
-
 	RTS_DEBUG("%s()\n", __func__);
 
-	for (epnum = 1; epnum < 4; epnum++) {
-		if (rtsusb->ep_in[epnum]->ep_enable) {
-			int_val = mc_read_reg(MC_FIFO0_IRQ + 0x100 *
-				  rtsusb->ep_in[epnum]->mcnum);
-			if (int_val & BIT(INT_LASTPKT_DONE_OFFSET)) {
-				RTS_DEBUG("irq: bulk in ep%d lastpkt done\n",
-					  epnum);
-				mc_set_reg_bit(INT_LASTPKT_DONE_OFFSET,
-				MC_FIFO0_IRQ +
-				0x100 * rtsusb->ep_in[epnum]->mcnum);
-				queue_work(rtsusb->udc_wq,
-					   &rtsusb->bulkin_work[epnum - 1]);
-			}
-		}
-	}
+	if (!(int_val & BIT(INT_LASTPKT_DONE_OFFSET)))
+		return 0;
 
-	return 0;
+	RTS_DEBUG("irq: bulk in ep%d lastpkt done\n", epnum);
+	rtsusb->irq_count[RTS_IRQ_BULK_IN]++;
+	mc_set_reg_bit(INT_LASTPKT_DONE_OFFSET,
+		       MC_FIFO0_IRQ + 0x100 * rtsusb->ep_in[epnum]->mcnum);
+	set_bit(epnum, &rtsusb->thread_pending);
+
+	return 1;
 }
 
 static void rts_usb_bulk_out_process(struct rts_endpoint *priv_ep)
 {
 	struct rts_request *priv_req = NULL;
+	bool chained;
 
 	RTS_DEBUG("%s() -> ep%d\n", __func__, priv_ep->epnum);
 
@@ -1753,39 +2500,34 @@ static void rts_usb_bulk_out_process(struct rts_endpoint *priv_ep)
 
 	priv_req = list_entry(priv_ep->queue.next, struct rts_request, queue);
 	rts_transfer_complete(priv_ep, priv_req);
+	chained = rts_chain_next_request(priv_ep, priv_req);
 	rts_done(priv_ep, priv_req, 0);
-	rts_start_next_request(priv_ep);
+	if (!chained)
+		rts_start_next_request(priv_ep);
 }
 
-static int rts_usb_bulkoutep_irq(struct rts_udc *rtsusb)
+static int rts_usb_bulkoutep_irq(struct rts_udc *rtsusb, int epnum,
+				 u32 int_val)
 {
-	u32 int_val;
-	int epnum;
-
 	RTS_DEBUG("%s()\n", __func__);
 
-	for (epnum = 1; epnum < 4; epnum++) {
-		if (rtsusb->ep_out[epnum]->ep_enable) {
-			int_val = mc_read_reg(MC_FIFO0_IRQ + 0x100 *
-					      rtsusb->ep_out[epnum]->mcnum);
-			if (int_val & BIT(INT_DMA_DONE_OFFSET)) {
-				RTS_DEBUG("irq: bulk out ep%d dma done\n",
-					  epnum);
-				usb_write_reg(0xe, USB_BULKOUTEPA_IRQ_STATUS +
-					      (epnum - 1) * 0x40);
-				mc_set_reg_bit(INT_DMA_DONE_OFFSET, MC_FIFO0_IRQ
-					+ 0x100 * rtsusb->ep_out[epnum]->mcnum);
-				rts_usb_bulk_out_process(rtsusb->ep_out[epnum]);
-			}
-		}
-	}
+	if (!(int_val & BIT(INT_DMA_DONE_OFFSET)))
+		return 0;
 
-	return 0;
+	RTS_DEBUG("irq: bulk out ep%d dma done\n", epnum);
+	rtsusb->irq_count[RTS_IRQ_BULK_OUT]++;
+	usb_write_reg(0xe, USB_BULKOUTEPA_IRQ_STATUS + (epnum - 1) * 0x40);
+	mc_set_reg_bit(INT_DMA_DONE_OFFSET,
+		       MC_FIFO0_IRQ + 0x100 * rtsusb->ep_out[epnum]->mcnum);
+	rts_usb_bulk_out_process(rtsusb->ep_out[epnum]);
+
+	return 1;
 }
 
 static void rts_usb_uac_in_process(struct rts_endpoint *priv_ep)
 {
 	struct rts_request *priv_req = NULL;
+	bool chained;
 
 	RTS_DEBUG("%s()\n", __func__);
 
@@ -1795,33 +2537,33 @@ static void rts_usb_uac_in_process(struct rts_endpoint *priv_ep)
 	priv_req = list_entry(priv_ep->queue.next, struct rts_request, queue);
 	if (priv_req->request.length)
 		rts_transfer_complete(priv_ep, priv_req);
+	chained = rts_chain_next_request(priv_ep, priv_req);
 	rts_done(priv_ep, priv_req, 0);
-	rts_start_next_request(priv_ep);
+	rts_uac_fill_ring(priv_ep);
+	if (!chained)
+		rts_start_next_request(priv_ep);
 }
 
-static int rts_usb_uacinep_irq(struct rts_udc *rtsusb)
+static int rts_usb_uacinep_irq(struct rts_udc *rtsusb, u32 int_val)
 {
-	u32 int_val;
-
 	RTS_DEBUG("%s()\n", __func__);
 
-	if (rtsusb->ep_in[4]->ep_enable) {
-		int_val = mc_read_reg(MC_FIFO0_IRQ + 0x100 *
-				      rtsusb->ep_in[4]->mcnum);
-		if (int_val & BIT(INT_LASTPKT_DONE_OFFSET)) {
-			RTS_DEBUG("irq: uac in ep4 lastpkt done\n");
-			mc_set_reg_bit(INT_LASTPKT_DONE_OFFSET, MC_FIFO0_IRQ +
-				       0x100 * rtsusb->ep_in[4]->mcnum);
-			rts_usb_uac_in_process(rtsusb->ep_in[4]);
-		}
-	}
+	if (!(int_val & BIT(INT_LASTPKT_DONE_OFFSET)))
+		return 0;
 
-	return 0;
+	RTS_DEBUG("irq: uac in ep4 lastpkt done\n");
+	rtsusb->irq_count[RTS_IRQ_UAC_IN]++;
+	mc_set_reg_bit(INT_LASTPKT_DONE_OFFSET,
+		       MC_FIFO0_IRQ + 0x100 * rtsusb->ep_in[4]->mcnum);
+	rts_usb_uac_in_process(rtsusb->ep_in[4]);
+
+	return 1;
 }
 
 static void rts_usb_uac_out_process(struct rts_endpoint *priv_ep)
 {
 	struct rts_request *priv_req = NULL;
+	bool chained;
 
 	RTS_DEBUG("%s()\n", __func__);
 
@@ -1830,33 +2572,32 @@ static void rts_usb_uac_out_process(struct rts_endpoint *priv_ep)
 
 	priv_req = list_entry(priv_ep->queue.next, struct rts_request, queue);
 	rts_transfer_complete(priv_ep, priv_req);
+	chained = rts_chain_next_request(priv_ep, priv_req);
 	rts_done(priv_ep, priv_req, 0);
-	rts_start_next_request(priv_ep);
+	if (!chained)
+		rts_start_next_request(priv_ep);
 }
 
-static int rts_usb_uacoutep_irq(struct rts_udc *rtsusb)
+static int rts_usb_uacoutep_irq(struct rts_udc *rtsusb, u32 int_val)
 {
-	u32 int_val;
-
 	RTS_DEBUG("%s()\n", __func__);
 
-	if (rtsusb->ep_out[4]->ep_enable) {
-		int_val = mc_read_reg(MC_FIFO0_IRQ + 0x100 *
-				      rtsusb->ep_out[4]->mcnum);
-		if (int_val & BIT(INT_DMA_DONE_OFFSET)) {
-			RTS_DEBUG("irq: uac out ep4 dma done\n");
-			mc_set_reg_bit(INT_DMA_DONE_OFFSET, MC_FIFO0_IRQ +
-				       0x100 * rtsusb->ep_out[4]->mcnum);
-			rts_usb_uac_out_process(rtsusb->ep_out[4]);
-		}
-	}
+	if (!(int_val & BIT(INT_DMA_DONE_OFFSET)))
+		return 0;
 
-	return 0;
+	RTS_DEBUG("irq: uac out ep4 dma done\n");
+	rtsusb->irq_count[RTS_IRQ_UAC_OUT]++;
+	mc_set_reg_bit(INT_DMA_DONE_OFFSET,
+		       MC_FIFO0_IRQ + 0x100 * rtsusb->ep_out[4]->mcnum);
+	rts_usb_uac_out_process(rtsusb->ep_out[4]);
+
+	return 1;
 }
 
 static void rts_usb_uvc_in_process(struct rts_endpoint *priv_ep)
 {
 	struct rts_request *priv_req = NULL;
+	bool chained;
 
 	RTS_DEBUG("%s()\n", __func__);
 
@@ -1866,68 +2607,100 @@ static void rts_usb_uvc_in_process(struct rts_endpoint *priv_ep)
 	priv_req = list_entry(priv_ep->queue.next, struct rts_request, queue);
 	if (priv_req->request.length)
 		rts_transfer_complete(priv_ep, priv_req);
-	rts_done_wq(priv_ep, priv_req, 0);
-	rts_start_next_request(priv_ep);
+	chained = rts_chain_next_request(priv_ep, priv_req);
+	rts_done(priv_ep, priv_req, 0);
+	if (!chained)
+		rts_start_next_request(priv_ep);
 }
 
-static void rts_usb_uvc_in_process_ep5(struct work_struct *work)
+static int rts_usb_uvcinep_irq(struct rts_udc *rtsusb, int epnum,
+			       u32 int_val)
 {
-	struct rts_udc *rtsusb = container_of(work, struct rts_udc,
-					      uvcin_work[0]);
-	struct rts_endpoint *priv_ep = rtsusb->ep_in[5];
+	u32 mcnum = rtsusb->ep_in[epnum]->mcnum;
 
-	rts_usb_uvc_in_process(priv_ep);
-}
+	RTS_DEBUG("%s()\n", __func__);
 
-static void rts_usb_uvc_in_process_ep6(struct work_struct *work)
-{
-	struct rts_udc *rtsusb = container_of(work, struct rts_udc,
-					      uvcin_work[1]);
-	struct rts_endpoint *priv_ep = rtsusb->ep_in[6];
+	if (!(int_val & BIT(INT_LASTPKT_DONE_OFFSET)))
+		return 0;
 
-	rts_usb_uvc_in_process(priv_ep);
+	RTS_DEBUG("irq: uvc in ep%d lastpkt done\n", epnum);
+	rtsusb->irq_count[RTS_IRQ_UVC_IN]++;
+	mc_set_reg_bit(INT_LASTPKT_DONE_OFFSET, MC_FIFO0_IRQ + 0x100 * mcnum);
+	mc_set_reg_bit(INT_DMA_DONE_OFFSET, MC_FIFO0_IRQ + 0x100 * mcnum);
+	set_bit(epnum, &rtsusb->thread_pending);
+
+	return 1;
 }
 
-static int rts_usb_uvcinep_irq(struct rts_udc *rtsusb)
+/*
+ * rts_usb_mc_irq
+ * One MC FIFO with its done interrupt enabled, handed to the handler of
+ * the endpoint it is mapped to.
+ */
+static int rts_usb_mc_irq(struct rts_udc *rtsusb, int mcnum)
 {
+	struct rts_endpoint *priv_ep = NULL;
+	struct rts_mcm *m = mcm[mcnum];
+	int epnum, ret = 0;
 	u32 int_val;
-	int epnum;
 
-	RTS_DEBUG("%s()\n", __func__);
+	/* mcm[] is owned by the device lock, the endpoint by its own */
+	spin_lock(&rtsusb->lock);
+	if (m->claimed)
+		priv_ep = m->dir_in ? rtsusb->ep_in[m->epnum] :
+				      rtsusb->ep_out[m->epnum];
+	spin_unlock(&rtsusb->lock);
 
-	for (epnum = 5; epnum < 7; epnum++) {
-		if (rtsusb->ep_in[epnum]->ep_enable) {
-			int_val = mc_read_reg(MC_FIFO0_IRQ + 0x100 *
-					      rtsusb->ep_in[epnum]->mcnum);
-			if (int_val & BIT(INT_LASTPKT_DONE_OFFSET)) {
-				RTS_DEBUG("irq: uvc in ep%d lastpkt done\n",
-					  epnum);
-				mc_set_reg_bit(INT_LASTPKT_DONE_OFFSET,
-					       MC_FIFO0_IRQ + 0x100 *
-					       rtsusb->ep_in[epnum]->mcnum);
-				mc_set_reg_bit(INT_DMA_DONE_OFFSET,
-					       MC_FIFO0_IRQ + 0x100 *
-					       rtsusb->ep_in[epnum]->mcnum);
-				rtsusb->uvcin_epnum = epnum;
-				queue_work(rtsusb->udc_wq,
-					   &rtsusb->uvcin_work[epnum - 5]);
-			}
+	if (!priv_ep)
+		return 0;
+
+	spin_lock(&priv_ep->lock);
+
+	if (!priv_ep->ep_enable || priv_ep->mcnum != mcnum)
+		goto out;
+
+	epnum = priv_ep->epnum;
+	int_val = mc_read_reg(MC_FIFO0_IRQ + 0x100 * mcnum);
+	if (priv_ep->dir_in) {
+		switch (epnum) {
+		case 1 ... 3:
+			ret = rts_usb_bulkinep_irq(rtsusb, epnum, int_val);
+			break;
+		case 4:
+			ret = rts_usb_uacinep_irq(rtsusb, int_val);
+			break;
+		case 5 ... 6:
+			ret = rts_usb_uvcinep_irq(rtsusb, epnum, int_val);
+			break;
+		default:
+			break;
+		}
+	} else {
+		switch (epnum) {
+		case 1 ... 3:
+			ret = rts_usb_bulkoutep_irq(rtsusb, epnum, int_val);
+			break;
+		case 4:
+			ret = rts_usb_uacoutep_irq(rtsusb, int_val);
+			break;
+		default:
+			break;
 		}
 	}
-
-	return 0;
+out:
+	spin_unlock(&priv_ep->lock);
+	return ret;
 }
 
-static void rts_usb_se0_irq(struct rts_udc *rtsusb)
+static void rts_usb_se0_irq(struct rts_udc *rtsusb, u32 int_val)
 {
-	u32 int_val;
-
 	RTS_DEBUG("%s()\n", __func__);
 
-	int_val = (usb_read_reg(USB_IRQ_EN) & usb_read_reg(USB_IRQ_STATUS));
 	if (int_val & BIT(I_SE0RSTF_OFFSET)) {
+		rtsusb->irq_count[RTS_IRQ_SE0]++;
 		usb_set_reg_bit(I_SE0RSTF_OFFSET, USB_IRQ_STATUS); /// clear irq
 		RTS_DEBUG("\nrecieve se0 irq\n");
+		rts_ep0_cache_invalidate(rtsusb, -1);
 		spin_unlock(&rtsusb->lock);
 		if (rtsusb->gadget_driver)
 			usb_gadget_udc_reset(&rtsusb->gadget,
@@ -1936,46 +2709,74 @@ static void rts_usb_se0_irq(struct rts_udc *rtsusb)
 	}
 }
 
-static int rts_usb_ep_irq(void *dev)
+/*
+ * rts_usb_ep_irq
+ * USB_IRQ_STATUS is read once for se0 and ep0. Endpoint sources are only
+ * polled when their interrupt is enabled, as tracked in mc_irq_en and
+ * intr_irq_en, instead of reading every enabled endpoint on every irq.
+ * se0 and ep0 run under the device lock, each endpoint under its own.
+ */
+static irqreturn_t rts_usb_ep_irq(void *dev)
 {
 	struct rts_udc *rtsusb = (struct rts_udc *)dev;
+	unsigned long pending;
+	int handled = 0;
+	u32 int_val;
+	int n;
 
 	RTS_DEBUG("%s()\n", __func__);
 
 	spin_lock(&rtsusb->lock);
 
-	rts_usb_se0_irq(rtsusb); /// root port reset irq
-
-	rts_usb_ep0_irq(rtsusb);
-
-	rts_usb_intrep_irq(rtsusb);
+	int_val = usb_read_reg(USB_IRQ_EN) & usb_read_reg(USB_IRQ_STATUS);
+	if (int_val & BIT(I_SE0RSTF_OFFSET)) {
+		rts_usb_se0_irq(rtsusb, int_val); /// root port reset irq
+		handled = 1;
+	}
 
-	rts_usb_bulkinep_irq(rtsusb);
+	if (int_val & (BIT(I_SETUPF_OFFSET) | BIT(I_EP0INF_OFFSET) |
+		       BIT(I_EP0OUTF_OFFSET))) {
+		rts_usb_ep0_irq(rtsusb, int_val);
+		handled = 1;
+	}
 
-	rts_usb_bulkoutep_irq(rtsusb);
+	spin_unlock(&rtsusb->lock);
 
-	rts_usb_uacinep_irq(rtsusb);
+	pending = rtsusb->intr_irq_en;
+	for_each_set_bit(n, &pending, RTS_EP_IN_MAX_COUNT)
+		handled |= rts_usb_intrep_irq(rtsusb, n);
 
-	rts_usb_uacoutep_irq(rtsusb);
+	pending = rtsusb->mc_irq_en;
+	for_each_set_bit(n, &pending, RTS_MCM_MAX_COUNT)
+		handled |= rts_usb_mc_irq(rtsusb, n);
 
-	rts_usb_uvcinep_irq(rtsusb);
+	if (!handled)
+		rtsusb->irq_count[RTS_IRQ_NONE]++;
 
-	spin_unlock(&rtsusb->lock);
+	if (READ_ONCE(rtsusb->thread_pending)) {
+		rts_stats_irq_wake(rtsusb);
+		return IRQ_WAKE_THREAD;
+	}
 
-	return IRQ_HANDLED;
+	return IRQ_RETVAL(handled);
 }
 
 static irqreturn_t rts_usb_common_irq(int irq, void *dev)
 {
-	int ret = IRQ_NONE;
+	irqreturn_t ret = IRQ_NONE;
 	struct rts_udc *rtsusb = (struct rts_udc *)dev;
 
 	RTS_DEBUG("%s() ~~start~~\n", __func__);
 #ifdef CONFIG_RTS3917_SUSPEND_TO_RAM
+	/* rts_usb_suspend() re-arms itself until the bus has been idle */
 	if (rtsusb->suspend_work.work.func) {
-		cancel_delayed_work(&rtsusb->suspend_work);
-		schedule_delayed_work(&rtsusb->suspend_work,
-					msecs_to_jiffies(1000));
+		WRITE_ONCE(rtsusb->last_activity, jiffies);
+		/* pairs with the barrier in rts_usb_suspend() */
+		smp_mb();
+		if (!atomic_read(&rtsusb->idle_armed) &&
+		    !atomic_xchg(&rtsusb->idle_armed, 1))
+			schedule_delayed_work(&rtsusb->suspend_work,
+				msecs_to_jiffies(RTS_IDLE_SUSPEND_MS));
 	}
 #endif
 
@@ -1983,7 +2784,38 @@ static irqreturn_t rts_usb_common_irq(int irq, void *dev)
 
 	RTS_DEBUG("%s() ~~end~~\n", __func__);
 	RTS_DEBUG("\n\n\n");
-	return IRQ_RETVAL(ret);
+	return ret;
+}
+
+/*
+ * rts_usb_thread_irq
+ * Bulk in and uvc in completions flagged by the hard irq handler. They are
+ * given back and the next request is armed here, in endpoint order, rather
+ * than from udc_wq.
+ */
+static irqreturn_t rts_usb_thread_irq(int irq, void *dev)
+{
+	struct rts_udc *rtsusb = (struct rts_udc *)dev;
+	unsigned long flags;
+	int epnum;
+
+	RTS_DEBUG("%s()\n", __func__);
+
+	rts_stats_thread(rtsusb);
+	for (epnum = 1; epnum < 7; epnum++) {
+		if (epnum == 4 ||
+		    !test_and_clear_bit(epnum, &rtsusb->thread_pending))
+			continue;
+
+		spin_lock_irqsave(&rtsusb->ep_in[epnum]->lock, flags);
+		if (epnum < 4)
+			rts_usb_bulk_in_process(rtsusb->ep_in[epnum]);
+		else
+			rts_usb_uvc_in_process(rtsusb->ep_in[epnum]);
+		spin_unlock_irqrestore(&rtsusb->ep_in[epnum]->lock, flags);
+	}
+
+	return IRQ_HANDLED;
 }
 
 static irqreturn_t rts_usb_phy_irq(int irq, void *dev)
@@ -2083,7 +2915,12 @@ static int rts_gadget_init_endpoints(struct rts_udc *rtsusb)
 				      &rtsusb->gadget.ep_list);
 
 		ep->rts_dev = rtsusb;
+		spin_lock_init(&ep->lock);
 		INIT_LIST_HEAD(&ep->queue);
+		INIT_LIST_HEAD(&ep->req_pool);
+		hrtimer_init(&ep->drain_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		ep->drain_timer.function = rts_fifo_drain_timer;
 		ep->endpoint.name = ep_in_names[i];
 		ep->endpoint.ops = &rts_ep_ops;
 		usb_ep_set_maxpacket_limit(&ep->endpoint, (unsigned short) ~0);
@@ -2127,7 +2964,13 @@ static int rts_gadget_init_endpoints(struct rts_udc *rtsusb)
 		list_add_tail(&ep->endpoint.ep_list,
 			      &rtsusb->gadget.ep_list);
 		ep->rts_dev = rtsusb;
+		spin_lock_init(&ep->lock);
 		INIT_LIST_HEAD(&ep->queue);
+		INIT_LIST_HEAD(&ep->req_pool);
+		/* never armed on out, but rts_ep_disable() cancels it */
+		hrtimer_init(&ep->drain_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		ep->drain_timer.function = rts_fifo_drain_timer;
 		ep->endpoint.name = ep_out_names[i];
 		ep->endpoint.ops = &rts_ep_ops;
 		usb_ep_set_maxpacket_limit(&ep->endpoint, (unsigned short) ~0);
@@ -2155,16 +2998,31 @@ static int rts_gadget_init_endpoints(struct rts_udc *rtsusb)
 	return 0;
 }
 
+static void rts_free_req_pool(struct rts_endpoint *priv_ep)
+{
+	struct rts_request *priv_req, *tmp;
+
+	list_for_each_entry_safe(priv_req, tmp, &priv_ep->req_pool, queue) {
+		list_del(&priv_req->queue);
+		kfree(priv_req);
+	}
+	priv_ep->req_pool_cnt = 0;
+}
+
 static int rts_gadget_free_endpoints(struct rts_udc *rtsusb)
 {
 	u8 i;
 
 	RTS_DEBUG("%s()\n", __func__);
 
-	for (i = 0; i < RTS_EP_IN_MAX_COUNT; i++)
+	for (i = 0; i < RTS_EP_IN_MAX_COUNT; i++) {
+		rts_free_req_pool(rtsusb->ep_in[i]);
 		list_del(&rtsusb->ep_in[i]->queue);
-	for (i = 1; i < RTS_EP_OUT_MAX_COUNT; i++)
+	}
+	for (i = 1; i < RTS_EP_OUT_MAX_COUNT; i++) {
+		rts_free_req_pool(rtsusb->ep_out[i]);
 		list_del(&rtsusb->ep_out[i]->queue);
+	}
 	return 0;
 }
 
@@ -2480,6 +3338,26 @@ static const struct usb_gadget_ops rts_gadget_ops = {
 
 static void rts_usb_suspend(struct work_struct *work)
 {
+	struct rts_udc *rtsusb = container_of(to_delayed_work(work),
+					      struct rts_udc, suspend_work);
+	unsigned long expires;
+
+	/*
+	 * Disarm before looking at last_activity: an irq that saw us armed
+	 * did not re-arm, so its activity must show up in the check below.
+	 */
+	atomic_set(&rtsusb->idle_armed, 0);
+	smp_mb__after_atomic();
+
+	expires = READ_ONCE(rtsusb->last_activity) +
+		  msecs_to_jiffies(RTS_IDLE_SUSPEND_MS);
+	if (time_before(jiffies, expires)) {
+		if (!atomic_xchg(&rtsusb->idle_armed, 1))
+			schedule_delayed_work(&rtsusb->suspend_work,
+					      expires - jiffies);
+		return;
+	}
+
 	pm_suspend(PM_SUSPEND_MEM);
 }
 
@@ -2656,8 +3534,15 @@ static int rts_usb_driver_probe(struct platform_device *pdev)
 	// 	goto err_init_usb;
 	// }
 
-	ret = devm_request_irq(dev, rtsusb->irq, rts_usb_common_irq,
-			       IRQF_SHARED, "rts_usb", (void *)rtsusb);
+	/* set up before the irq, which arms it */
+	wakeup = of_property_read_bool(dev->of_node, "wakeup-source");
+	device_init_wakeup(dev, wakeup);
+	if (wakeup)
+		INIT_DELAYED_WORK(&rtsusb->suspend_work, rts_usb_suspend);
+
+	ret = devm_request_threaded_irq(dev, rtsusb->irq, rts_usb_common_irq,
+					rts_usb_thread_irq, IRQF_SHARED,
+					"rts_usb", (void *)rtsusb);
 	// if (ret) {
 	// 	dev_err(dev, "request usb irq failed\n");
 	// 	goto err;
@@ -2671,6 +3556,7 @@ static int rts_usb_driver_probe(struct platform_device *pdev)
 	// }
 
 	ret = usb_add_gadget_udc(dev, &rtsusb->gadget); /// 注册udc
+	rts_usb_debugfs_init(rtsusb);
 	// if (ret) {
 	// 	dev_err(dev, "register udc failed\n");
 	// 	goto err;
@@ -2682,25 +3568,15 @@ static int rts_usb_driver_probe(struct platform_device *pdev)
 	// 	goto err;
 	// }
 
-	INIT_WORK(&rtsusb->uvcin_work[0], rts_usb_uvc_in_process_ep5);
-	INIT_WORK(&rtsusb->uvcin_work[1], rts_usb_uvc_in_process_ep6);
 	INIT_WORK(&rtsusb->uvcin_done_work[0], rts_done_uvc_in_disable_ep5);
 	INIT_WORK(&rtsusb->uvcin_done_work[1], rts_done_uvc_in_disable_ep6);
 	INIT_WORK(&rtsusb->test_work, rts_usb_test_mode);
-	INIT_WORK(&rtsusb->bulkin_work[0], rts_usb_bulk_in_process_ep1);
-	INIT_WORK(&rtsusb->bulkin_work[1], rts_usb_bulk_in_process_ep2);
-	INIT_WORK(&rtsusb->bulkin_work[2], rts_usb_bulk_in_process_ep3);
 
 	dev_info(dev, "Initialized Realtek IPCam USB Device module\n");
 
 	if ((val & UPHY_DEV_PORT_VBUS_INT_MSK) == UPHY_DEV_PORT_VBUS_ON_INT)
 		usb_gadget_vbus_connect(&rtsusb->gadget);
 
-	wakeup = of_property_read_bool(dev->of_node, "wakeup-source");
-	device_init_wakeup(dev, wakeup);
-	if (wakeup)
-		INIT_DELAYED_WORK(&rtsusb->suspend_work, rts_usb_suspend);
-
 	return ret;
 err:
 err_init_usb:
@@ -2716,11 +3592,16 @@ static int rts_usb_driver_remove(struct platform_device *pdev)
 	struct rts_udc *rtsusb = platform_get_drvdata(pdev);
 	struct device *dev = &pdev->dev;
 
+	rts_usb_debugfs_remove(rtsusb);
 	usb_del_gadget_udc(&rtsusb->gadget);
 	rts_ep_free_request(&rtsusb->ep_in[0]->endpoint, rtsusb->ep0_req);
 	rts_gadget_free_endpoints(rtsusb);
 	rts_gadget_pullup(&rtsusb->gadget, 0);
+	/* the irq queues both works, so it has to go first */
+	devm_free_irq(dev, rtsusb->irq, rtsusb);
 	destroy_workqueue(rtsusb->udc_wq);
+	if (rtsusb->suspend_work.work.func)
+		cancel_delayed_work_sync(&rtsusb->suspend_work);
 	device_init_wakeup(dev, 0);
 
 	return 0;
@@ -3,6 +3,9 @@
  *  Copyright (C) 2021 Realtek Semiconductor Corp.
  *  All Rights Reserved
  */
+#ifndef __RTS_USB_CORE_H
+#define __RTS_USB_CORE_H
+
 #include "regs.h"
 #include "mc_regs.h"
 
@@ -33,6 +36,49 @@
 #define UPHY_DEV_PORT_VBUS_NULL_MSK	0x01
 
 #define UDC_QUIRK_DYNAMIC_MAXPKTSIZE	BIT(1)
+
+/* freed request objects kept per endpoint for reuse */
+#define RTS_REQ_POOL_MAX		16
+
+/* bulk in fifo drain polling */
+#define RTS_HS_BYTE_NS			17	/* 480 Mbit/s */
+#define RTS_FS_BYTE_NS			667	/* 12 Mbit/s */
+#define RTS_FIFO_DRAIN_MIN_NS		1000
+#define RTS_FIFO_DRAIN_TIMEOUT_NS	(10 * NSEC_PER_MSEC)
+/* uac in packet size table, two 11 bit entries per register */
+#define RTS_UAC_RING_SIZE		20
+#define RTS_UAC_RING_REGS		(RTS_UAC_RING_SIZE / 2)
+/* suspend to ram after this long without a udc interrupt */
+#define RTS_IDLE_SUSPEND_MS		1000
+/* ep0 class GET_* replies served from the irq, see ep0_cache */
+#define RTS_EP0_CACHE_SLOTS		16
+#define RTS_EP0_CACHE_DATA		64
+/* log2 buckets of the debugfs latency histograms */
+#define RTS_HIST_BUCKETS		28
+/* interrupt sources counted by rts_usb_ep_irq() */
+enum rts_irq_src {
+	RTS_IRQ_SE0,
+	RTS_IRQ_SETUP,
+	RTS_IRQ_EP0_IN,
+	RTS_IRQ_EP0_OUT,
+	RTS_IRQ_INTR_IN,
+	RTS_IRQ_BULK_IN,
+	RTS_IRQ_BULK_OUT,
+	RTS_IRQ_UAC_IN,
+	RTS_IRQ_UAC_OUT,
+	RTS_IRQ_UVC_IN,
+	RTS_IRQ_NONE,
+	RTS_IRQ_SRC_MAX,
+};
+
+/* uvc in request length buckets, see rts_uvc_build_plan() */
+enum rts_uvc_bucket {
+	RTS_UVC_SHORT,
+	RTS_UVC_SINGLE,
+	RTS_UVC_MULTI,
+	RTS_UVC_BUCKETS,
+};
+
 /*-------------------------------------------------------------------------*/
 /* Used structs */
 struct udc_devtype_data {
@@ -41,10 +87,42 @@ struct udc_devtype_data {
 
 struct rts_udc;
 
+/* Per endpoint statistics, log2 histograms, see debugfs "stats" */
+struct rts_ep_stats {
+	u64					bytes;
+	u64					requests;
+	u32					errors;
+	u32					queue_hwm;
+	u32					iso_underrun;
+	u32					iso_missed;
+	u32					queue_hist[RTS_HIST_BUCKETS];
+	u32					xfer_hist[RTS_HIST_BUCKETS];
+
+	/* iso in: queue ran empty at t_idle */
+	bool					idle;
+	u64					t_idle;
+};
+
+struct rts_ep0_cache {
+	struct usb_ctrlrequest			setup;
+	u16					len;
+	bool					valid;
+	u8					data[RTS_EP0_CACHE_DATA]
+						__aligned(4);
+};
+
+struct rts_uvc_plan {
+	u32					limit[RTS_UVC_BUCKETS];
+	u16					maxpkt[RTS_UVC_BUCKETS];
+	u8					pid[RTS_UVC_BUCKETS];
+};
+
 struct rts_endpoint {
 	struct usb_ep				endpoint;
 	struct rts_udc				*rts_dev;
 
+	/* queue and state lock, taken before rts_udc.lock */
+	spinlock_t				lock;
 	struct list_head			queue;
 	unsigned				stall:1;
 	unsigned				wedged:1;
@@ -56,11 +134,32 @@ struct rts_endpoint {
 	unsigned char				dir_in;
 	unsigned char				dir_out;
 	const struct usb_endpoint_descriptor	*desc;
-	/* for usc in ep */
+	/* for uac in ep: next free slot and slots owned by queued requests */
 	int					uac_cnt;
+	int					uac_filled;
 	bool					is_uac_in;
+	u32					uac_pktsize[RTS_UAC_RING_REGS];
 	u16					maxpkt;
 	int					pid;
+	/* uvc in: payload header length last written to USB_DUMMY0 */
+	u32					hdr_len;
+	struct rts_uvc_plan			uvc_plan;
+	/* bulk in: next request held until the MC FIFO has drained */
+	struct hrtimer				drain_timer;
+	ktime_t					drain_start;
+	bool					drain_pending;
+	u32					fifo_not_drained;
+	u32					fifo_drain_timeout;
+	u64					fifo_drain_ns;
+	u64					fifo_drain_max_ns;
+	/* freed requests, reused by rts_ep_alloc_request() */
+	struct list_head			req_pool;
+	unsigned int				req_pool_cnt;
+
+	unsigned int				queue_depth;
+	/* iso: one service interval, for counting missed ones */
+	u64					interval_ns;
+	struct rts_ep_stats			stats;
 };
 
 struct rts_mcm {
@@ -75,6 +174,12 @@ struct rts_request {
 	struct list_head			queue;
 	u16					ep0_in_last_length;
 	u16					intr_in_last_length;
+	/* uac in: packet size table slot written for this request */
+	u8					uac_slot;
+	bool					uac_slotted;
+	/* debugfs stats: queued and started on the MC FIFO */
+	u64					t_queue;
+	u64					t_start;
 };
 
 struct rts_udc {
@@ -83,7 +188,10 @@ struct rts_udc {
 	struct usb_gadget		gadget;
 	struct usb_gadget_driver	*gadget_driver;
 
-	/* device lock */
+	/*
+	 * device lock: ep0, setup/reset state, mcm[] and registers shared
+	 * between endpoints. Nests inside rts_endpoint.lock.
+	 */
 	spinlock_t			lock;
 
 	struct usb_ctrlrequest		*setup_buf;
@@ -97,25 +205,42 @@ struct rts_udc {
 	struct usb_request		*ep0_req; /* for internal request */
 	__le16				ep0_data;
 
+	/* setup whose data stage is captured into ep0_cache[] on queue */
+	bool				ep0_cache_pending;
+	unsigned int			ep0_cache_next;
+	u32				ep0_cache_hits;
+	struct rts_ep0_cache		ep0_cache[RTS_EP0_CACHE_SLOTS];
+
 	u8				devstatus;
 
 	/* gadget start */
 	u8				gadgetstart;
 	/* vbus on */
 	u8				vbuson;
-	u32				request_pending;
-
-	unsigned char			uvcin_epnum;
+	atomic_t			request_pending;
+
+	/* interrupt enabled sources, bit per mcnum / interrupt epnum */
+	unsigned long			mc_irq_en;
+	unsigned long			intr_irq_en;
+	u32				irq_count[RTS_IRQ_SRC_MAX];
+
+	/* bulk in/uvc in completions for the irq thread, bit per epnum */
+	unsigned long			thread_pending;
+	u64				t_irq;
+	u32				thread_hist[RTS_HIST_BUCKETS];
+	struct dentry			*debugfs;
 	struct workqueue_struct		*udc_wq;
-	struct work_struct		uvcin_work[2];
 	struct work_struct		uvcin_done_work[2];
 	struct work_struct		test_work;
 	int				test_mode;
 
 	const struct udc_devtype_data	*devtype_data;
 	struct delayed_work		suspend_work;
-	struct work_struct		bulkin_work[3];
+	unsigned long			last_activity;	/* jiffies */
+	atomic_t			idle_armed;
 #define USB_FS_CLK			2140000
 #define USB_HS_CLK			125000000
 	struct clk			*bus_clk;
 };
+
+#endif /* __RTS_USB_CORE_H */
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Realtek IPCam USB Device tracepoints
+ *
+ *  Copyright (C) 2021 Realtek Semiconductor Corp.
+ *  All Rights Reserved
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rts_udc
+
+#if !defined(__RTS_UDC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __RTS_UDC_TRACE_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+#include "core.h"
+
+DECLARE_EVENT_CLASS(rts_log_request,
+	TP_PROTO(struct rts_endpoint *priv_ep, struct rts_request *priv_req),
+	TP_ARGS(priv_ep, priv_req),
+	TP_STRUCT__entry(
+		__string(name, priv_ep->endpoint.name)
+		__field(struct rts_request *, req)
+		__field(unsigned int, length)
+		__field(unsigned int, actual)
+		__field(int, status)
+		__field(unsigned char, mcnum)
+		__field(unsigned int, depth)
+	),
+	TP_fast_assign(
+		__assign_str(name, priv_ep->endpoint.name);
+		__entry->req = priv_req;
+		__entry->length = priv_req->request.length;
+		__entry->actual = priv_req->request.actual;
+		__entry->status = priv_req->request.status;
+		__entry->mcnum = priv_ep->mcnum;
+		__entry->depth = priv_ep->queue_depth;
+	),
+	TP_printk("%s: req %p length %u/%u status %d mc%u depth %u",
+		__get_str(name), __entry->req, __entry->actual,
+		__entry->length, __entry->status, __entry->mcnum,
+		__entry->depth)
+);
+
+DEFINE_EVENT(rts_log_request, rts_ep_queue,
+	TP_PROTO(struct rts_endpoint *priv_ep, struct rts_request *priv_req),
+	TP_ARGS(priv_ep, priv_req)
+);
+
+DEFINE_EVENT(rts_log_request, rts_ep_start,
+	TP_PROTO(struct rts_endpoint *priv_ep, struct rts_request *priv_req),
+	TP_ARGS(priv_ep, priv_req)
+);
+
+DEFINE_EVENT(rts_log_request, rts_ep_done,
+	TP_PROTO(struct rts_endpoint *priv_ep, struct rts_request *priv_req),
+	TP_ARGS(priv_ep, priv_req)
+);
+
+/* isochronous in endpoint ran out of requests */
+DEFINE_EVENT(rts_log_request, rts_iso_underrun,
+	TP_PROTO(struct rts_endpoint *priv_ep, struct rts_request *priv_req),
+	TP_ARGS(priv_ep, priv_req)
+);
+
+TRACE_EVENT(rts_iso_missed,
+	TP_PROTO(struct rts_endpoint *priv_ep, u64 idle_ns, u32 missed),
+	TP_ARGS(priv_ep, idle_ns, missed),
+	TP_STRUCT__entry(
+		__string(name, priv_ep->endpoint.name)
+		__field(u64, idle_ns)
+		__field(u32, missed)
+	),
+	TP_fast_assign(
+		__assign_str(name, priv_ep->endpoint.name);
+		__entry->idle_ns = idle_ns;
+		__entry->missed = missed;
+	),
+	TP_printk("%s: idle %llu ns, %u service intervals missed",
+		__get_str(name), __entry->idle_ns, __entry->missed)
+);
+
+#endif /* __RTS_UDC_TRACE_H */
+
+/* this part has to be here */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>